@@ -23,7 +23,9 @@ extern "C"
 #include "headers/util.hpp"
 
 #include "learner/logistic_trsgd.hpp"
+#include "learner/hogwild.hpp"
 #include "feeder/rtb2a/feeder.hpp"
+#include "feeder/pipeline.hpp"
 
 /**
  * Get payingprice of a Sample
@@ -47,6 +49,16 @@ inline uint32_t get_score(const Sample& sample)
 	return (uint32_t)score;
 }
 
+/**
+ * Set the response and weight of a Sample.
+ */
+inline void label_sample(Sample& sample)
+{
+	uint32_t score = get_score(sample);
+	sample.y  = (score>0?1:-1); // y \in {-1,1}
+	sample.wt = (score>0?500*score:1); // Very Imbalance!
+}
+
 /**
  * Print and Reset statistics.
  */
@@ -72,8 +84,31 @@ typedef struct
 {
 	char * head; ///< head address of the memory.
 	uint64_t size; ///< size (in byte) of the memry
+	double weight; ///< weight of the data file
 } Memdata;
 
+/**
+ * Make n Feeder with the same data, the first one is feeder itself.
+ *
+ * Delete the others after usage.
+ */
+vector<Feeder*> make_feeders(Feeder& feeder, const vector<Memdata>& memdata,
+		const Memdata& cachedata, uint32_t n)
+{
+	vector<Feeder*> feeders(1,&feeder);
+	for(uint32_t i=1;i<n;i++)
+	{
+		Feeder * f = new Feeder();
+		for(auto it=memdata.begin();it!=memdata.end();++it)
+			f->link(it->head,it->size,it->weight);
+		if(cachedata.head!=NULL)
+			f->link_cache(cachedata.head,cachedata.size);
+		f->random_seek();
+		feeders.push_back(f);
+	}
+	return feeders;
+}
+
 
 /**
  * @brief Main Program Entrance.
@@ -92,7 +127,7 @@ int main(int argc, char* argv[])
 	lcg64(get_nsec());
 	if(argc<3)
 	{
-		printf(" Usage: %s DATALIST N_ITER [START_ITER]\n",argv[0]);
+		printf(" Usage: %s DATALIST N_ITER [START_ITER] [N_THREAD] [N_PARSER] [CACHE]\n",argv[0]);
 		exit(0);
 	}
 	// Loading Data
@@ -118,21 +153,76 @@ int main(int argc, char* argv[])
 			char * memhead = NULL;
 			uint64_t memsize = mmap_datafile(buffer,&memhead);
 			feeder.link(memhead,memsize,weight);
-			memdata.push_back({memhead,memsize});
+			memdata.push_back({memhead,memsize,weight});
 		}
 		fclose(f);
 	}		
+	uint32_t n_thread = 1;
+	if(argc>4)
+		n_thread = strtol(argv[4],NULL,10);
+	// Replay the parsed Sample in CACHE if it exists, else write them to it
+	Memdata cachedata = {NULL,0,0};
+	CacheWriter * cache_writer = NULL;
+	if(argc>6)
+	{
+		if(0==access(argv[6],R_OK))
+		{
+			cachedata.size = mmap_datafile(argv[6],&cachedata.head);
+			feeder.link_cache(cachedata.head,cachedata.size);
+		}
+		else if(n_thread>1)
+			warning("%s is not written with N_THREAD>1.\n",argv[6]);
+		else
+			cache_writer = new CacheWriter(argv[6]);
+	}
 	feeder.random_seek();
 	Parameter param_learner("param_learner.txt");
 	param_learner.print();
 	LR_Learner learner(80);
-	learner.load("model.txt");
-	learner.par = &param_learner;
+	if(0==access("model.bin",R_OK)) // binary snapshot first
+		learner.load("model.bin");
+	else
+		learner.load("model.txt");
+	learner.set_param(&param_learner);
+	learner.set_incremental(param_learner.incremental);
+	learner.set_cap(param_learner.cap);
+	learner.set_admission(param_learner.admit,param_learner.admit_width);
+	learner.set_alloc(param_learner.alloc);
+	learner.set_dense(param_learner.dense);
 	uint64_t start_iter = 0;
 	if(argc>3)
 		start_iter = strtol(argv[3],NULL,10);
 	learner.iter = start_iter;
-	Sample sample(512);
+	if(n_thread>1)
+	{
+		// Hogwild! training, each thread has its own Feeder
+		vector<Feeder*> feeders = make_feeders(feeder,memdata,cachedata,n_thread);
+		info("n_iter: %lu  start_iter: %lu  n_thread: %u\n",
+				strtol(argv[2],NULL,10),start_iter,n_thread);
+		Hogwild<Feeder> hogwild(learner);
+		hogwild.run(feeders,strtol(argv[2],NULL,10),label_sample);
+		for(uint32_t i=1;i<n_thread;i++)
+			delete feeders[i];
+		learner.save_binary("model.bin");
+		learner.save("model.txt");
+		for(auto it=memdata.begin();it!=memdata.end();++it)
+			munmap(it->head,it->size);
+		if(cachedata.head!=NULL)
+			munmap(cachedata.head,cachedata.size);
+		return 0;
+	}
+	// Parse in n_parser other threads if n_parser>0
+	uint32_t n_parser = 0;
+	if(argc>5)
+		n_parser = strtol(argv[5],NULL,10);
+	vector<Feeder*> feeders;
+	Pipeline<Feeder>* pipeline = NULL;
+	if(n_parser>0)
+	{
+		feeders = make_feeders(feeder,memdata,cachedata,n_parser);
+		pipeline = new Pipeline<Feeder>(feeders,label_sample,300000);
+	}
+	Sample slot(512);
 	const uint64_t n_iter = strtol(argv[2],NULL,10);
 	info("n_iter: %lu  start_iter: %lu\n",n_iter,start_iter);
 	uint64_t sum_score = 0;
@@ -156,10 +246,13 @@ int main(int argc, char* argv[])
 	{
 		// Learn and Predict
 		//feeder.random_seek();
-		feeder.feed(sample);
+		if(pipeline==NULL)
+		{
+			feeder.feed(slot);
+			label_sample(slot);
+		}
+		const Sample& sample = (pipeline==NULL?slot:pipeline->pop());
 		uint32_t score = get_score(sample);
-		sample.y  = (score>0?1:-1); // y \in {-1,1}
-		sample.wt = (score>0?500*score:1); // Very Imbalance!
 		double f = learner.digest(sample);
 		double p = 1/(1+exp(-f));
 		// Second model
@@ -178,12 +271,24 @@ int main(int argc, char* argv[])
 			stat_score[get_payingprice(sample)/20] += score;
 			stat_exp[get_payingprice(sample)/20] += get_payingprice(sample);
 		}
+		if(cache_writer!=NULL)
+			cache_writer->write(sample);
+		if(pipeline!=NULL)
+			pipeline->release();
 		if(iter % 300000 == 0) // approx. 1 sec
 		{
 			print_reset(learner,sum_score,sum_expense,max_score,max_expense);
-			feeder.random_seek();
+			if(pipeline==NULL)
+				feeder.random_seek();
 		}
 	}
+	if(pipeline!=NULL)
+	{
+		pipeline->print();
+		delete pipeline;
+		for(uint32_t i=1;i<n_parser;i++)
+			delete feeders[i];
+	}
 	// Stop timer
 	clock_gettime(CLOCK_REALTIME, &spec_b);
 	info("[%s] End Parsing.\n",qstrtime());
@@ -195,11 +300,16 @@ int main(int argc, char* argv[])
 	printf("\n");
 	for(int i=0;i<16;i++)
 		printf("%lu,%lu\n",all_exp[i],all_score[i]);
+	if(cache_writer!=NULL)
+		delete cache_writer;
 	// Save
+	learner.save_binary("model.bin");
 	learner.save("model.txt");
 	//free(mem_train);
 	for(auto it=memdata.begin();it!=memdata.end();++it)
 		munmap(it->head,it->size);
+	if(cachedata.head!=NULL)
+		munmap(cachedata.head,cachedata.size);
 	return 0;
 }
 
@@ -130,8 +130,16 @@ int main(int argc, char* argv[])
 	Parameter param_learner("param_learner.txt");
 	param_learner.print();
 	LR_Learner learner(80);
-	learner.load("model.txt");
-	learner.par = &param_learner;
+	if(0==access("model.bin",R_OK)) // binary snapshot first
+		learner.load("model.bin");
+	else
+		learner.load("model.txt");
+	learner.set_param(&param_learner);
+	learner.set_incremental(param_learner.incremental);
+	learner.set_cap(param_learner.cap);
+	learner.set_admission(param_learner.admit,param_learner.admit_width);
+	learner.set_alloc(param_learner.alloc);
+	learner.set_dense(param_learner.dense);
 	uint64_t start_iter = 0;
 	if(argc>3)
 		start_iter = strtol(argv[3],NULL,10);
@@ -200,6 +208,7 @@ int main(int argc, char* argv[])
 	for(int i=0;i<16;i++)
 		printf("%3d<=pay<%3d %10lu,%8lu\n",i*20,(i+1)*20,all_exp[i],all_score[i]);
 	// Save
+	learner.save_binary("model.bin");
 	learner.save("model.txt");
 	//free(mem_train);
 	for(auto it=memdata.begin();it!=memdata.end();++it)
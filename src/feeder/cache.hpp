@@ -0,0 +1,189 @@
+/**
+ * @file cache.hpp
+ * @brief Binary cache of parsed Sample.
+ * @author linus
+ * @version 1.0
+ * @date 2013-10-03
+ */
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "headers/error.hpp"
+#include "headers/datatype.hpp"
+#include "headers/lcg64.hpp"
+
+/**
+ * File format of the Sample cache.
+ *
+ * A CacheHead, then n_sample records, then the index.
+ * Each record is a CacheRecord followed by len Feature (as in memory),
+ * so everything is 8-byte aligned and can be used in place after mmap.
+ * The index holds the offsets of every (1<<CACHE_INDEX_SHIFT)-th record,
+ * for random_seek().
+ */
+#define CACHE_MAGIC 0x4353524cu // "LRSC"
+#define CACHE_VERSION 1
+#define CACHE_INDEX_SHIFT 10
+
+/**
+ * Head of a Sample cache file.
+ */
+typedef struct
+{
+	uint32_t magic; ///< CACHE_MAGIC
+	uint32_t version; ///< CACHE_VERSION
+	uint32_t feature_size; ///< sizeof(Feature) of the writer
+	uint32_t reserved; ///< 0
+	uint64_t n_sample; ///< number of records
+	uint64_t index_offset; ///< where the index starts
+} CacheHead;
+
+/**
+ * Head of a record in the Sample cache.
+ */
+typedef struct
+{
+	uint32_t len; ///< number of Feature
+	float y; ///< Sample::y
+	double wt; ///< Sample::wt
+} CacheRecord;
+
+/**
+ * Write Sample to a cache file.
+ */
+class CacheWriter
+{
+private:
+	FILE * f; ///< file to write
+	CacheHead head; ///< head to write on close()
+	uint64_t offset; ///< size written
+	std::vector<uint64_t> index; ///< offsets of indexed records
+
+public:
+	/**
+	 * Open a cache file for writing.
+	 */
+	CacheWriter(const char * filename): f(NULL), offset(0)
+	{
+		f = fopen(filename,"wb");
+		if(!f)
+			error("Cannot open %s for writing.\n",filename);
+		memset(&head,0,sizeof(head));
+		head.magic = CACHE_MAGIC;
+		head.version = CACHE_VERSION;
+		head.feature_size = sizeof(Feature);
+		qassert(1==fwrite(&head,sizeof(head),1,f));
+		offset = sizeof(head);
+	}
+
+	~CacheWriter() { close(); }
+
+	/**
+	 * Append a Sample.
+	 */
+	void write(const Sample& s)
+	{
+		if((head.n_sample & ((1<<CACHE_INDEX_SHIFT)-1)) == 0)
+			index.push_back(offset);
+		CacheRecord r = {s.len,s.y,s.wt};
+		qassert(1==fwrite(&r,sizeof(r),1,f));
+		qassert(s.len==fwrite(s.x,sizeof(Feature),s.len,f));
+		offset += sizeof(r) + s.len*sizeof(Feature);
+		head.n_sample++;
+	}
+
+	/**
+	 * Write the index and the head, then close the file.
+	 */
+	void close()
+	{
+		if(f==NULL)
+			return;
+		head.index_offset = offset;
+		if(index.size()>0)
+			qassert(index.size()==fwrite(&index[0],sizeof(uint64_t),index.size(),f));
+		qassert(0==fseek(f,0,SEEK_SET));
+		qassert(1==fwrite(&head,sizeof(head),1,f));
+		fclose(f);
+		f = NULL;
+		info("%lu samples cached.\n",head.n_sample);
+	}
+};
+
+/**
+ * Read Sample from a (memory mapped) cache file.
+ */
+class CacheReader
+{
+private:
+	const char * mem; ///< head address of the file
+	const CacheHead * head; ///< head of the file
+	const uint64_t * index; ///< index of the file
+	const char * p; ///< the next record
+
+public:
+	CacheReader(): mem(NULL), head(NULL), index(NULL), p(NULL) {}
+
+	/**
+	 * Use a mapped cache file.
+	 */
+	void link(const char * _mem, uint64_t _len)
+	{
+		qassert(_len>=sizeof(CacheHead));
+		mem = _mem;
+		head = (const CacheHead*)mem;
+		if(head->magic!=CACHE_MAGIC or head->version!=CACHE_VERSION)
+			error("Not a Sample cache of version %u.\n",CACHE_VERSION);
+		if(head->feature_size!=sizeof(Feature))
+			error("Cache has Feature of %u bytes, expect %lu.\n",
+					head->feature_size,sizeof(Feature));
+		if(head->n_sample==0)
+			error("Empty Sample cache.\n");
+		uint64_t n_index = ((head->n_sample-1)>>CACHE_INDEX_SHIFT)+1;
+		qassert(head->index_offset+n_index*sizeof(uint64_t)<=_len);
+		index = (const uint64_t*)(mem+head->index_offset);
+		p = mem + sizeof(CacheHead);
+	}
+
+	/**
+	 * Whether a cache is linked.
+	 */
+	bool linked() const { return mem!=NULL; }
+
+	/**
+	 * Number of Sample in cache.
+	 */
+	uint64_t size() const { return head->n_sample; }
+
+	/**
+	 * Random pick a record ( for future reading ).
+	 */
+	void random_seek()
+	{
+		uint64_t r = lcg64()%head->n_sample;
+		p = mem + index[r>>CACHE_INDEX_SHIFT];
+		for(r&=(1<<CACHE_INDEX_SHIFT)-1;r>0;r--)
+			p += sizeof(CacheRecord) + ((const CacheRecord*)p)->len*sizeof(Feature);
+	}
+
+	/**
+	 * Feed a Sample slot with the next record.
+	 */
+	void feed(Sample& slot)
+	{
+		const CacheRecord* r = (const CacheRecord*)p;
+		slot.reserve(r->len);
+		memcpy(slot.x,p+sizeof(CacheRecord),r->len*sizeof(Feature));
+		slot.len = r->len;
+		slot.y = r->y;
+		slot.wt = r->wt;
+		p += sizeof(CacheRecord) + r->len*sizeof(Feature);
+		if(p==mem+head->index_offset)
+			p = mem + sizeof(CacheHead);
+	}
+};
+
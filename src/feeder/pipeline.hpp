@@ -0,0 +1,202 @@
+/**
+ * @file pipeline.hpp
+ * @brief Parse Sample in other threads while learning.
+ * @author linus
+ * @version 1.0
+ * @date 2013-10-03
+ */
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+extern "C"
+{
+#include <pthread.h>
+#include <sched.h>
+}
+
+#include "headers/error.hpp"
+#include "headers/time.hpp"
+#include "headers/lcg64.hpp"
+#include "headers/datatype.hpp"
+#include "headers/ring.hpp"
+
+/**
+ * A producer/consumer pipeline between Feeder and Learner.
+ *
+ * Each parser thread owns a FEEDER and a SampleRing. It feeds the Sample
+ * slots of its ring in place, and the learner thread takes them with pop()
+ * and gives them back with release(), in turn from the rings that are
+ * not empty. So the learner does not wait for parsing as long as the parsers
+ * keep up, and a full ring makes its parser wait (backpressure).
+ *
+ * print() shows how often each stage had to wait and the mean occupancy
+ * of the rings: a full pipeline means learning is the bottleneck, an empty
+ * one means parsing is.
+ */
+template <class FEEDER>
+class Pipeline
+{
+public:
+	typedef void (*LABEL)(Sample&); ///< set y and wt for a fed Sample
+
+private:
+	/**
+	 * Argument of a parser thread.
+	 */
+	typedef struct
+	{
+		Pipeline* p; ///< who starts the thread
+		uint32_t id; ///< thread id
+	} Parser;
+
+	std::vector<FEEDER*> feeders; ///< one for each parser
+	std::vector<SampleRing*> rings; ///< one for each parser
+	std::vector<pthread_t> tid; ///< parser threads
+	std::vector<Parser> arg; ///< argument of parser threads
+	LABEL label; ///< label function, called in parser threads
+	uint64_t seek_every; ///< call random_seek() every this many Sample
+	volatile bool stop; ///< tell parsers to quit
+	uint32_t cur; ///< the ring to pop next
+	SampleRing* popped; ///< the ring of the Sample being used
+
+public:
+	/**
+	 * Start a parser thread for each feeder.
+	 *
+	 * @param _feeders linked feeders, one for each parser thread
+	 * @param _label set y and wt of the Sample, if not NULL
+	 * @param _seek_every if not 0, each parser calls random_seek()
+	 *        after so many Sample
+	 * @param ring_size number of Sample slots for each parser
+	 */
+	Pipeline(std::vector<FEEDER*>& _feeders, LABEL _label = NULL,
+			uint64_t _seek_every = 0, uint32_t ring_size = 1024):
+		feeders(_feeders), rings(_feeders.size(),NULL),
+		tid(_feeders.size()), arg(_feeders.size()),
+		label(_label), seek_every(_seek_every), stop(false),
+		cur(0), popped(NULL)
+	{
+		qassert(feeders.size()>0);
+		for(uint32_t i=0;i<feeders.size();i++)
+			rings[i] = new SampleRing(ring_size);
+		for(uint32_t i=0;i<feeders.size();i++)
+		{
+			arg[i] = {this,i};
+			if(0!=pthread_create(&tid[i],NULL,work,&arg[i]))
+				error("pthread_create() failed for thread %u.\n",i);
+		}
+	}
+
+	~Pipeline()
+	{
+		stop = true;
+		for(uint32_t i=0;i<tid.size();i++)
+			pthread_join(tid[i],NULL);
+		for(uint32_t i=0;i<rings.size();i++)
+			delete rings[i];
+	}
+
+	/**
+	 * Get the next Sample, wait if all the rings are empty.
+	 *
+	 * The Sample is valid until release().
+	 */
+	Sample& pop()
+	{
+		qassert(popped==NULL);
+		const uint32_t n = rings.size();
+		for(bool waited=false;;)
+		{
+			for(uint32_t i=0;i<n;i++)
+			{
+				SampleRing* r = rings[cur];
+				cur = (cur+1==n?0:cur+1);
+				Sample* s = r->try_pop();
+				if(s!=NULL)
+				{
+					popped = r;
+					return *s;
+				}
+			}
+			if(not waited)
+			{
+				rings[cur]->n_empty++;
+				waited = true;
+			}
+			sched_yield();
+		}
+	}
+
+	/**
+	 * Give back the Sample got by pop().
+	 */
+	void release()
+	{
+		qassert(popped!=NULL);
+		popped->commit_pop();
+		popped = NULL;
+	}
+
+	/**
+	 * Print the statistics of each stage.
+	 */
+	void print() const
+	{
+		uint64_t n_pop = 0, n_full = 0, n_empty = 0, sum_occupancy = 0;
+		for(uint32_t i=0;i<rings.size();i++)
+		{
+			n_pop += rings[i]->n_pop();
+			n_full += rings[i]->n_full;
+			n_empty += rings[i]->n_empty;
+			sum_occupancy += rings[i]->sum_occupancy;
+		}
+		const double occupancy = (n_pop>0?(double)sum_occupancy/n_pop:0);
+		info("Pipeline: %lu parsers, %lu samples, parser waits %lu, "
+				"learner waits %lu, occupancy %.1lf/%u\n",
+				rings.size(),n_pop,n_full,n_empty,
+				occupancy,rings[0]->max_size());
+		if(n_full>n_empty)
+			info("Pipeline: learning is the bottleneck.\n");
+		else if(n_empty>n_full)
+			info("Pipeline: parsing is the bottleneck.\n");
+	}
+
+private:
+	/**
+	 * Entrance of parser threads.
+	 */
+	static void* work(void * _arg)
+	{
+		Parser* w = (Parser*)_arg;
+		w->p->loop(w->id);
+		return NULL;
+	}
+
+	/**
+	 * Main loop of a parser.
+	 */
+	void loop(uint32_t id)
+	{
+		lcg64(get_nsec()+id*A_LEcuyer1);
+		FEEDER* f = feeders[id];
+		SampleRing* r = rings[id];
+		for(uint64_t count=1;;count++)
+		{
+			Sample* s = r->push(&stop);
+			if(s==NULL)
+				break;
+			f->feed(*s);
+			if(label)
+				label(*s);
+			r->commit_push();
+			if(seek_every!=0 and count % seek_every == 0)
+				f->random_seek();
+		}
+	}
+
+	Pipeline(const Pipeline&);
+	Pipeline& operator=(const Pipeline&);
+};
+
@@ -13,9 +13,11 @@
 #include "headers/error.hpp"
 #include "headers/datatype.hpp"
 #include "headers/bigmap2.hpp"
+#include "headers/swissmap.hpp"
 #include "headers/lcg64.hpp"
 
 #include "./parser.hpp"
+#include "feeder/cache.hpp"
 #include <vector>
 #include <random>
 
@@ -41,10 +43,12 @@ typedef struct
 class Feeder
 {
 public:
-	BigMap<2,uint32_t> m; ///< Stored clk(in v[0]) and conv(in v[1]) info.
+	typedef BigMap<2,uint32_t> MAP; ///< or SwissMap<2,uint32_t>
+	MAP m; ///< Stored clk(in v[0]) and conv(in v[1]) info.
 	vector<Mem> mem; ///< A vector of Mem (storing raw txt data).
 	const char * p; ///< current pointer (to read in a sample line).
 	vector<Mem>::iterator cur; ///< which Mem we are currently parsing.
+	CacheReader cache; ///< parsed Sample to replay instead, if linked.
 
 	Feeder()
 	{
@@ -88,7 +92,7 @@ public:
 
 	~Feeder()
 	{
-		m.~BigMap();
+		m.dtor();
 	}
 
 	/**
@@ -119,11 +123,26 @@ public:
 		}
 	}
 
+	/**
+	 * Replay Sample from a mapped cache file instead of parsing.
+	 *
+	 * See feeder/cache.hpp for the format.
+	 */
+	void link_cache(const char * _memhead, uint64_t _memsize)
+	{
+		cache.link(_memhead,_memsize);
+	}
+
 	/**
 	 * Random pick a file and a line ( for future reading ).
 	 */	
 	void random_seek()
 	{
+		if(cache.linked())
+		{
+			cache.random_seek();
+			return;
+		}
 		// draw cur
 		double ran = (double)lcg64()/(uint64_t)~0;
 		do {
@@ -143,6 +162,11 @@ public:
 	 */	
 	void feed(Sample& slot)
 	{
+		if(cache.linked())
+		{
+			cache.feed(slot);
+			return;
+		}
 		slot.len = 0;
 		p = parseline2(p,slot);
 		if(p==cur->head + cur->len)
@@ -0,0 +1,149 @@
+/**
+ * @file alloc.hpp
+ * @brief Allocation of big arrays, on huge pages and NUMA nodes.
+ * @author linus
+ * @version 1.0
+ * @date 2013-10-03
+ */
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+extern "C"
+{
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+}
+
+#include "headers/error.hpp"
+
+/**
+ * Allocation policy of big_alloc(), a kind of pages or'ed with
+ * a NUMA placement.
+ *
+ * The pages of a random-accessed array of several GB on 4 KB pages
+ * miss the TLB on nearly every lookup. With huge pages of 2 MB,
+ * one TLB entry covers 512 times more memory.
+ */
+#define ALLOC_PLAIN 0 ///< calloc(), as the kernel pleases
+#define ALLOC_THP 1 ///< mmap() and madvise(MADV_HUGEPAGE), transparent huge pages
+#define ALLOC_HUGETLB 2 ///< mmap() with MAP_HUGETLB from the reserved pool, else as ALLOC_THP
+#define ALLOC_INTERLEAVE 4 ///< interleave the pages over the NUMA nodes with memory
+#define ALLOC_LOCAL 8 ///< put the pages on the NUMA node of the allocating thread
+
+#define ALLOC_MIN_MAP (1lu<<21) ///< arrays smaller than a huge page are calloc()'ed
+
+// from linux/mempolicy.h
+#define ALLOC_MPOL_INTERLEAVE 3
+#define ALLOC_MPOL_LOCAL 4
+
+/**
+ * Whether big_alloc() maps an array of bytes by policy, thus big_free()
+ * should unmap it.
+ */
+inline bool big_mapped(uint64_t bytes, uint32_t policy)
+{
+	return policy!=ALLOC_PLAIN and bytes>=ALLOC_MIN_MAP;
+}
+
+/**
+ * Length of the mapping of an array of bytes, in whole huge pages.
+ */
+inline uint64_t big_map_len(uint64_t bytes)
+{
+	return (bytes+ALLOC_MIN_MAP-1)&~(ALLOC_MIN_MAP-1);
+}
+
+/**
+ * Set the NUMA policy of a mapping before it is touched, by mbind().
+ *
+ * It calls the system call directly, as libnuma may not be installed.
+ * A failure is warned once, the pages are placed as usual then.
+ */
+inline void big_bind(void * p, uint64_t len, uint32_t policy)
+{
+	static bool warned = false;
+	unsigned long mask = 0;
+	int mode = ALLOC_MPOL_LOCAL;
+	if(policy & ALLOC_INTERLEAVE)
+	{
+		mode = ALLOC_MPOL_INTERLEAVE;
+		FILE * f = fopen("/sys/devices/system/node/has_memory","r");
+		uint32_t a, b;
+		char c = ',';
+		while(f!=NULL and c==',' and fscanf(f,"%u",&a)==1)
+		{
+			b = a;
+			if(fscanf(f,"%c",&c)==1 and c=='-' and fscanf(f,"%u%c",&b,&c)<1)
+				break;
+			for(;a<=b and a<64;a++)
+				mask |= 1lu<<a;
+		}
+		if(f!=NULL)
+			fclose(f);
+		if(mask==0)
+			mask = 1;
+	}
+	if(0!=syscall(SYS_mbind,p,len,mode,mode==ALLOC_MPOL_LOCAL?NULL:&mask,
+				mode==ALLOC_MPOL_LOCAL?0:65,0) and not warned)
+	{
+		warning("mbind() failed, NUMA policy 0x%x ignored.\n",policy);
+		warned = true;
+	}
+}
+
+/**
+ * Allocate an array of bytes of zeros by policy, return NULL if failed.
+ *
+ * It is freed by big_free() with the same bytes and policy.
+ * A mapping is rounded up to whole huge pages. ALLOC_HUGETLB falls back
+ * to ALLOC_THP (with a warning once) if no huge page is reserved,
+ * see /proc/sys/vm/nr_hugepages.
+ */
+inline void* big_alloc(uint64_t bytes, uint32_t policy)
+{
+	if(not big_mapped(bytes,policy))
+		return calloc(bytes,1);
+	static bool warned = false;
+	const uint64_t len = big_map_len(bytes);
+	void * p = MAP_FAILED;
+	if(policy & ALLOC_HUGETLB)
+	{
+		p = mmap(NULL,len,PROT_READ|PROT_WRITE,
+				MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB,-1,0);
+		if(p==MAP_FAILED and not warned)
+		{
+			warning("mmap(MAP_HUGETLB) failed, use transparent huge pages.\n");
+			warned = true;
+		}
+	}
+	if(p==MAP_FAILED)
+	{
+		p = mmap(NULL,len,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+		if(p==MAP_FAILED)
+			return NULL;
+		if(policy & (ALLOC_THP|ALLOC_HUGETLB))
+			madvise(p,len,MADV_HUGEPAGE);
+	}
+	if(policy & (ALLOC_INTERLEAVE|ALLOC_LOCAL))
+		big_bind(p,len,policy);
+	return p;
+}
+
+/**
+ * Free an array allocated by big_alloc().
+ */
+inline void big_free(void * p, uint64_t bytes, uint32_t policy)
+{
+	if(p==NULL)
+		return;
+	if(big_mapped(bytes,policy))
+		munmap(p,big_map_len(bytes));
+	else
+		free(p);
+}
+
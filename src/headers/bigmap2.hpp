@@ -12,6 +12,18 @@
 #include <cstring>
 #include <cmath>
 #include "headers/error.hpp"
+#include "headers/hash.hpp"
+#include "headers/alloc.hpp"
+
+/**
+ * How many keys ahead find_batch() and get_batch() prefetch.
+ */
+#define PREFETCH_DISTANCE 8
+
+/**
+ * How many unreferred Atom evict() compares to choose a victim.
+ */
+#define EVICT_SAMPLE 4
 
 /**
  * Power 2 Ceiling.
@@ -28,49 +40,173 @@ inline uint32_t power2ceil(uint32_t x)
 	return rtn;
 }
 
+/**
+ * Power 2 Ceiling, for 2<=x<2**63. See power2ceil(uint32_t).
+ */
+inline uint64_t power2ceil(uint64_t x)
+{
+	qassert(x<=(~0lu>>1));
+	uint64_t rtn = 1;
+	while(rtn!=0 and rtn<x)
+		rtn <<= 1;
+	return rtn;
+}
+
 /**
  * A unit of (key,value) in BigMap
  *
  * Note that T should be basic types, need not T() or ~T(),
- * and can be initialized by bzero or equivalence.
+ * and can be initialized by bzero or equivalence,
+ * e.g. float, uint32_t, or fp16 and bf16 of half.hpp.
+ *
+ * K is the type of the stored key, whose top 2 bits are the state of
+ * the slot, see fold(). A uint32_t key makes Atom<2,float> 12 bytes
+ * instead of 16, a uint16_t key makes Atom<2,uint16_t> 6 bytes.
  */
-template <unsigned N, typename T>
+template <unsigned N, typename T, typename K = uint64_t>
 class Atom
 { 
 public:
-	uint64_t k; ///< Key
+	typedef T VALUE;
+
+	K k; ///< Key
 	T v[N]; ///< Value
 
+	static const unsigned KEY_BITS = sizeof(K)*8-2; ///< bits of k for the key
+	static const K STATE = (K)((K)3<<KEY_BITS); ///< bits of k for the state
+
 	/**
 	 * Default constructor.
 	 *
 	 * if True, then memset 0.
 	 */
 	Atom(bool set_zero): k(0) { if(set_zero) memset(v,0,N*sizeof(T)); }
+
+	/**
+	 * The key stored for a 64-bit key k, without the state bits.
+	 *
+	 * A key below 2**KEY_BITS is kept as it is, e.g. an hour or an OS id,
+	 * others are folded to a fingerprint of KEY_BITS bits by fmix().
+	 * Two keys of the same fingerprint share an Atom, which is likely
+	 * among sqrt(2**KEY_BITS) hashed keys: about 32 K for uint32_t,
+	 * 128 for uint16_t. So a narrow K is for a space of few keys.
+	 * fold(fold(k))==fold(k), thus a saved map loads the same.
+	 */
+	static inline K fold(uint64_t k)
+	{
+		k &= ~(3lu<<62);
+		if(KEY_BITS>=62 or k<(1lu<<KEY_BITS))
+			return (K)k;
+		return (K)(fmix(k)>>(64-KEY_BITS));
+	}
 };
 
 /**
  * A HashMap like structure.
  *
  * This is usually known as Open Addressing. See [CLRS] 11.4
+ *
+ * It probes linearly from the home slot of a key, picked by fmix(), and
+ * erase() shifts the following Atom of the cluster backward to fill the
+ * hole (see [Knuth] 6.4 Algorithm R), so it leaves no corpse behind:
+ * probe chains do not grow with erase() and insertion churn, and the map
+ * is rehashed only to grow. The order of traversal starts after an empty
+ * slot and wraps around, so an Atom shifted by erase() is never visited
+ * twice or skipped.
+ *
+ * A bit for each slot records whether it is living, so a traversal
+ * scans the bitmap a word at a time, and costs one bit for each empty
+ * slot instead of reading its Atom.
+ *
+ * When set_incremental() is called with a step > 0, growing the map
+ * does not stop the world. A new array is allocated, and the old one is
+ * kept until all its Atom are moved: each operator[], erase() and remove()
+ * moves the Atom in the next step slots of the old array, and the Atom
+ * touched by operator[] is moved at once. get() and find() look in both.
+ * So an insertion costs at most step moves more than usual, plus
+ * an allocation of the new array, whose pages are zeroed by the kernel lazily.
+ * The price is that both arrays are kept until the moving is done.
+ *
+ * When set_cap() is called with a cap > 0, it keeps at most cap Atom,
+ * operator[] evicts one (see evict()) before inserting a new key if full.
+ * A byte for each slot records whether it is referred by find()
+ * or operator[] since the hand of the CLOCK passed it. (get() does not
+ * count, and a new Atom is not referred until it is found again.)
+ *
+ * The arrays are allocated by big_alloc() with the policy of set_alloc(),
+ * e.g. on huge pages. (The bitmaps and the referred bytes are small,
+ * they are always calloc()'ed.)
+ *
+ * When set_dense() is called with an n > 0, the keys below n are kept
+ * in a plain array at their own index, as a space of small integer keys
+ * (hours, regions, ad sizes) needs no hashing or probing. Other keys
+ * are hashed as usual, so both kinds mix in one map.
+ *
+ * I is the type of slot indices and counts. uint32_t keeps the map
+ * smaller for up to 2**31 slots, uint64_t lifts that limit for
+ * a space of billions of keys, costing only a larger BigMap struct.
+ *
+ * K is the type of the stored keys, see Atom::fold(). A key is folded
+ * when it comes in, so a narrower K costs nothing more per lookup, but
+ * keys of the same fingerprint share an Atom, and the keys saved or
+ * traversed are the folded ones.
  */
-template <unsigned N, typename T>
+template <unsigned N, typename T, typename I = uint32_t, typename K = uint64_t>
 class BigMap
 {
+public:
+	typedef Atom<N,T,K> ATOM;
+
 private:
-	uint32_t max_len; ///< max number of Atom. Should be in the power of 2
-	uint32_t len; ///< number of Atom stored. the count of 0b11
-	uint32_t mask; ///< mask.
-	uint32_t vacancy; ///< number of Atom corpse. the count of 0b01
+	I max_len; ///< max number of Atom. Should be in the power of 2
+	I len; ///< number of Atom stored. the count of 0b11
+	I mask; ///< mask.
+	mutable I head; ///< an empty slot where traversal starts, see begin()
+	uint32_t gen; ///< generation, changed when an ATOM* may become invalid
+	uint32_t inc_step; ///< slots to move per operation, 0 for stop-the-world
+	bool borrowed; ///< whether array is not ours to free, see link()
+	uint32_t alloc; ///< policy of big_alloc() for new arrays, see set_alloc()
+	uint32_t array_alloc; ///< policy array was allocated by
+	I cap; ///< max number of Atom, 0 for no limit
+	I hand; ///< hand of the CLOCK, see evict()
+	uint64_t n_evicted; ///< number of Atom evicted
+	uint32_t n_rehash; ///< number of rehash by rehash_if_overfull()
+	uint8_t* ref; ///< referred bit of each slot, only if cap>0
+	I dense_len; ///< keys below it are kept in dense, see set_dense()
+	I dense_count; ///< number of living Atom in dense
+	ATOM* dense; ///< Atom of key k at dense[k], NULL until a key below dense_len comes
+
+	static const unsigned SHIFT = ATOM::KEY_BITS; ///< state = k>>SHIFT
+	static const K LIVING = ATOM::STATE; ///< state 0b11
+	static const K CORPSE = (K)((K)1<<SHIFT); ///< state 0b01
 
-	typedef Atom<N,T> ATOM;
 	ATOM* array;
+	uint64_t* bits; ///< occupancy bitmap of array, a bit for each slot
+
+	// The old array when moving incrementally, see set_incremental().
+	I old_max_len; ///< max_len of old array
+	I old_len; ///< number of living Atom in old array
+	I old_mask; ///< mask of old array
+	I old_pos; ///< slots before this are moved
+	ATOM* old; ///< old array, NULL if not moving
+	uint64_t* old_bits; ///< occupancy bitmap of old array
+	uint32_t old_alloc; ///< policy old array was allocated by
 
 public:
 
-	BigMap(): max_len(0),len(0),mask(0),vacancy(0),array(NULL) {}
+	BigMap(): max_len(0),len(0),mask(0),head(0),gen(0),inc_step(0),
+		borrowed(false),alloc(ALLOC_PLAIN),array_alloc(ALLOC_PLAIN),
+		cap(0),hand(0),n_evicted(0),n_rehash(0),ref(NULL),
+		dense_len(0),dense_count(0),dense(NULL),array(NULL),
+		bits(NULL),old_max_len(0),old_len(0),old_mask(0),old_pos(0),old(NULL),
+		old_bits(NULL),old_alloc(ALLOC_PLAIN) {}
 	
-	BigMap(uint32_t _max_len): max_len(0),len(0),mask(0),vacancy(0),array(NULL)
+	BigMap(I _max_len): max_len(0),len(0),mask(0),head(0),gen(0),
+		inc_step(0),borrowed(false),alloc(ALLOC_PLAIN),array_alloc(ALLOC_PLAIN),
+		cap(0),hand(0),n_evicted(0),n_rehash(0),ref(NULL),
+		dense_len(0),dense_count(0),dense(NULL),array(NULL),bits(NULL),
+		old_max_len(0),old_len(0),old_mask(0),old_pos(0),old(NULL),
+		old_bits(NULL),old_alloc(ALLOC_PLAIN)
 	{
 		rehash(_max_len);
 	}
@@ -79,10 +215,36 @@ public:
 
 	void dtor()
 	{
+		if(ref!=NULL)
+		{
+			free(ref);
+			ref = NULL;
+		}
+		if(dense!=NULL)
+		{
+			free(dense);
+			dense = NULL;
+			dense_count = 0;
+		}
+		if(old!=NULL)
+		{
+			big_free(old,(uint64_t)old_max_len*sizeof(ATOM),old_alloc);
+			free(old_bits);
+			old = NULL;
+			old_bits = NULL;
+			old_max_len = old_len = old_mask = old_pos = 0;
+		}
 		if(array==NULL)
 			return;
-		free(array);
+		if(not borrowed)
+		{
+			big_free(array,(uint64_t)max_len*sizeof(ATOM),array_alloc);
+			free(bits);
+		}
 		array = NULL;
+		bits = NULL;
+		borrowed = false;
+		max_len = len = mask = 0;
 	}
 
 	/**
@@ -90,36 +252,246 @@ public:
 	 */
 	inline void print() const
 	{
-		printf("max_len %u, len %u, vacancy %u, array %p\n",
-				max_len,len,vacancy,array);
+		printf("max_len %lu, len %lu, array %p\n",
+				(uint64_t)max_len,(uint64_t)len,array);
+		if(old!=NULL)
+			printf("old_max_len %lu, old_len %lu, old_pos %lu, old %p\n",
+					(uint64_t)old_max_len,(uint64_t)old_len,(uint64_t)old_pos,old);
+	}
+
+	/**
+	 * Grow incrementally, moving step slots per operation. (0 to disable)
+	 *
+	 * A step of at least 4 makes sure the moving is done before
+	 * the new array is overfull.
+	 */
+	void set_incremental(uint32_t step)
+	{
+		inc_step = step;
+		if(step==0)
+			finish_moving();
+	}
+
+	/**
+	 * Allocate the arrays from now on by policy, see big_alloc().
+	 *
+	 * ALLOC_PLAIN by default. The array in use is not moved,
+	 * the policy applies from the next rehash.
+	 */
+	void set_alloc(uint32_t policy) { alloc = policy; }
+
+	/**
+	 * Keep the keys below n in a plain array, indexed by key. (0 to disable)
+	 *
+	 * The array of n Atom is calloc()'ed at the first key below n,
+	 * so a map of hashed keys costs nothing for it. Those Atom are never
+	 * evicted nor counted by the cap, and their ATOM* stay valid until
+	 * erase(), clear() or set_dense(). The Atom already stored move to
+	 * where they belong. It stays in effect after load() and link().
+	 */
+	void set_dense(I n)
+	{
+		if(n==dense_len)
+			return;
+		finish_moving();
+		ATOM* d = dense;
+		const I d_len = dense_len;
+		dense = NULL;
+		dense_len = n;
+		dense_count = 0;
+		gen++;
+		if(d!=NULL)
+		{
+			for(I k=0;k<d_len;k++)
+				if(d[k].k>>SHIFT==3)
+					memcpy(at(k).v,d[k].v,N*sizeof(T));
+			free(d);
+		}
+		to_dense();
+	}
+
+	/**
+	 * Number of Atom of the array of set_dense(), 0 if not allocated.
+	 */
+	I dense_size() const { return dense!=NULL?dense_len:0; }
+
+	/**
+	 * The n of set_dense().
+	 */
+	I dense_limit() const { return dense_len; }
+
+	/**
+	 * Keep at most _cap Atom, evict() when more. (0 for no limit)
+	 *
+	 * The array grows to at most power2ceil(4*_cap) slots,
+	 * of sizeof(Atom) bytes and a referred byte each.
+	 */
+	void set_cap(I _cap)
+	{
+		cap = _cap;
+		alloc_ref();
+		if(cap>0 and len+old_len>cap)
+			evict(len+old_len-cap);
+	}
+
+	/**
+	 * Whether it keeps as many Atom as its cap. (see set_dense())
+	 */
+	bool full() const { return cap>0 and len+old_len>=cap; }
+
+	/**
+	 * Number of Atom evicted so far.
+	 */
+	uint64_t evictions() const { return n_evicted; }
+
+	/**
+	 * Number of rehash done because it was overfull.
+	 */
+	uint32_t rehashes() const { return n_rehash; }
+
+	/**
+	 * Evict n living Atom, by CLOCK with weight.
+	 *
+	 * The hand sweeps the array, an Atom referred since it was passed
+	 * gets a second chance, and the one with the least |v[0]| among
+	 * the next EVICT_SAMPLE Atom not referred is erased.
+	 */
+	void evict(I n = 1)
+	{
+		finish_moving();
+		for(;n>0 and len>0;n--)
+		{
+			erase(victim());
+			n_evicted++;
+		}
+	}
+
+	/**
+	 * Return the hashed Atom evict() would erase next, NULL if none.
+	 *
+	 * It moves the hand, and clears the referred bytes it passes.
+	 */
+	ATOM* victim()
+	{
+		finish_moving();
+		ATOM* victim = NULL;
+		double least = 0;
+		uint32_t n_candidate = 0;
+		// every bit is cleared in the first round
+		for(uint64_t i=0;len>0 and i<2lu*max_len and n_candidate<EVICT_SAMPLE;i++)
+		{
+			ATOM* t = array+hand;
+			hand = (hand+1)&mask;
+			if(t->k>>SHIFT!=3)
+				continue;
+			if(ref!=NULL and ref[t-array]!=0)
+			{
+				ref[t-array] = 0;
+				continue;
+			}
+			const double w = fabs((double)t->v[0]);
+			if(victim==NULL or w<least)
+			{
+				victim = t;
+				least = w;
+			}
+			n_candidate++;
+		}
+		return victim;
+	}
+
+	/**
+	 * Whether t points to an Atom slot of this map.
+	 */
+	bool owns(const ATOM* t) const
+	{
+		return (array<=t and t<array+max_len) or
+			(old!=NULL and old<=t and t<old+old_max_len) or
+			(dense!=NULL and dense<=t and t<dense+dense_len);
+	}
+
+	/**
+	 * Whether there is an old array not moved yet.
+	 */
+	bool moving() const { return old!=NULL; }
+
+	/**
+	 * Move everything left in the old array.
+	 */
+	void finish_moving()
+	{
+		if(old!=NULL)
+			move_old(old_max_len);
 	}
 
 private:
-	bool _find(uint64_t k, uint32_t & index_found, uint32_t & index_new) const
+	/**
+	 * Home slot of key k in an array of mask+1 slots.
+	 */
+	static inline I home(K k, I mask)
+	{
+		return (I)fmix((uint64_t)(k & ~LIVING)) & mask;
+	}
+
+	/**
+	 * Words of the occupancy bitmap of _max_len slots.
+	 */
+	static inline uint64_t bitmap_words(I _max_len)
+	{
+		return ((uint64_t)_max_len+63)>>6;
+	}
+
+	/**
+	 * Return the first living slot in [from,to) of a bitmap, or to if none.
+	 */
+	static inline I next_bit(const uint64_t* b, I from, I to)
+	{
+		if(from>=to)
+			return to;
+		uint64_t w = from>>6;
+		uint64_t word = b[w] & (~0lu<<(from&63));
+		while(word==0)
+		{
+			if((++w)<<6 >= to)
+				return to;
+			word = b[w];
+		}
+		const uint64_t i = (w<<6) + __builtin_ctzl(word);
+		return i<to?i:to;
+	}
+
+	/**
+	 * Allocate a blank occupancy bitmap of _max_len slots.
+	 */
+	static uint64_t* alloc_bits(I _max_len)
+	{
+		uint64_t* b = (uint64_t*)calloc(bitmap_words(_max_len),sizeof(uint64_t));
+		if(!b)
+			error("calloc(%lu,8) returned NULL.\n",bitmap_words(_max_len));
+		return b;
+	}
+
+	inline void set_bit(I index) { bits[index>>6] |= 1lu<<(index&63); }
+	inline void clear_bit(I index) { bits[index>>6] &= ~(1lu<<(index&63)); }
+
+	bool _find(K k, I & index_found, I & index_new) const
 	// Find key k, return whether found
 	// when found, save index in index_found.
 	// when no-found, save insert index in index_new.
 	{
-		uint32_t count_miss = 0;
-		index_found = ~0u;
-		index_new = ~0u;
-		uint32_t index = k & mask; // which bucket to look for
+		I count_miss = 0;
+		index_found = ~(I)0;
+		index_new = ~(I)0;
+		I index = home(k,mask); // which bucket to look for
 		while(true)
 		{
-			switch((array[index].k>>62)&3)
+			switch((array[index].k>>SHIFT)&3)
 			{
 				case 0: // 0b00 : nothing
-					if(index_new==~0u)
-						index_new = index;
+					index_new = index;
 					return false;
-				case 1: // 0b01 : corpse
-					if(index_new==~0u)
-						index_new = index;
-					if(((array[index].k^k)&~(3lu<<62))==0)
-						return false;
-					break;
 				case 3: // 0b11 : living
-					if(((array[index].k^k)&~(3lu<<62))==0)
+					if(((array[index].k^k)&~LIVING)==0)
 					{
 						index_found = index;
 						return true;
@@ -131,30 +503,32 @@ private:
 			count_miss ++;
 			if(count_miss==max_len)
 				return false;
-			index = (index+count_miss)&mask;
+			index = (index+1)&mask;
 		}
 	}
 
-	bool _find(uint64_t k, uint32_t & index_found) const
-	// Find key k, return whether found
+	static bool _find(const ATOM* array, I max_len, I mask,
+			K k, I & index_found)
+	// Find key k in array, return whether found
 	// when found, save index in index_found.
-	// when no-found, save ~0u in index_found.
+	// when no-found, save ~(I)0 in index_found.
+	// The old array may have corpses (0b01) left by erase(), see move_one().
 	{
-		uint32_t count_miss = 0;
-		index_found = ~0u;
-		uint32_t index = k & mask; // which bucket to look for
+		I count_miss = 0;
+		index_found = ~(I)0;
+		I index = home(k,mask); // which bucket to look for
 		while(true)
 		{
-			switch((array[index].k>>62)&3)
+			switch((array[index].k>>SHIFT)&3)
 			{
 				case 0: // 0b00
 					return false;
 				case 1: // 0b01
-					if(((array[index].k^k)&~(3lu<<62))==0)
+					if(((array[index].k^k)&~LIVING)==0)
 						return false;
 					break;
 				case 3: // 0b11
-					if(((array[index].k^k)&~(3lu<<62))==0)
+					if(((array[index].k^k)&~LIVING)==0)
 					{
 						index_found = index;
 						return true;
@@ -166,40 +540,306 @@ private:
 			count_miss ++;
 			if(count_miss==max_len)
 				return false;
-			index = (index+count_miss)&mask;
+			index = (index+1)&mask;
 		}
 	}
 
+	bool _find(K k, I & index_found) const
+	{
+		return _find(array,max_len,mask,k,index_found);
+	}
+
+	ATOM* _find_any(K k) const
+	// Find key k in array, then in old array, return NULL if not found.
+	{
+		I index_found;
+		if(_find(k,index_found))
+			return array+index_found;
+		if(old!=NULL and _find(old,old_max_len,old_mask,k,index_found))
+			return old+index_found;
+		return NULL;
+	}
+
+	/**
+	 * Put key k (not in array) to array and return it.
+	 */
+	ATOM* _insert(K k)
+	{
+		I index_found, index_new;
+		if(_find(k,index_found,index_new))
+			return array+index_found;
+		array[index_new].k = k | LIVING;
+		set_bit(index_new);
+		len++;
+		return array+index_new;
+	}
+
+	/**
+	 * Erase the living Atom at index of array, by backward shift.
+	 *
+	 * Each following Atom of the cluster that may live nearer to its
+	 * home slot is moved to the hole, leaving a new hole where it was,
+	 * until an empty slot. Only slots in the same cluster are written.
+	 */
+	void _erase(I index)
+	{
+		for(I i=(index+1)&mask;array[i].k>>SHIFT!=0;i=(i+1)&mask)
+		{
+			// move it unless its home is cyclically in (index,i]
+			const I h = home(array[i].k,mask);
+			if(((i-h)&mask) < ((i-index)&mask))
+				continue;
+			memcpy(array+index,array+i,sizeof(ATOM));
+			if(ref!=NULL)
+				ref[index] = ref[i];
+			index = i;
+		}
+		array[index].k = 0;
+		memset(array[index].v,0,N*sizeof(T));
+		clear_bit(index);
+		if(ref!=NULL)
+			ref[index] = 0;
+		len--;
+		gen++;
+	}
+
+	/**
+	 * Move the Atom in old array at t to array, return where it is now.
+	 */
+	ATOM* move_one(ATOM* t)
+	{
+		ATOM* a = _insert(t->k);
+		memcpy(a->v,t->v,N*sizeof(T));
+		t->k = (t->k & ~LIVING) | CORPSE;
+		memset(t->v,0,N*sizeof(T));
+		old_bits[(t-old)>>6] &= ~(1lu<<((t-old)&63));
+		old_len--;
+		gen++;
+		return a;
+	}
+
+	/**
+	 * Move the Atom in the next n slots of the old array.
+	 */
+	void move_old(I n)
+	{
+		for(;n>0 and old_pos<old_max_len;n--,old_pos++)
+			if(old[old_pos].k>>SHIFT==3)
+				move_one(old+old_pos);
+		if(old_pos==old_max_len)
+		{
+			qassert(old_len==0);
+			big_free(old,(uint64_t)old_max_len*sizeof(ATOM),old_alloc);
+			free(old_bits);
+			old = NULL;
+			old_bits = NULL;
+			old_max_len = old_mask = old_pos = 0;
+			gen++;
+		}
+	}
+
+	/**
+	 * Start moving to a new array of new_max_len.
+	 */
+	void start_moving(I new_max_len)
+	{
+		qassert(old==NULL);
+		ATOM* new_array = (ATOM*)big_alloc((uint64_t)new_max_len*sizeof(ATOM),alloc);
+		if(!new_array)
+			error("big_alloc(%lu*%lu) returned NULL.\n",(uint64_t)new_max_len,sizeof(ATOM));
+		old = array;
+		old_bits = bits;
+		old_alloc = array_alloc;
+		old_max_len = max_len;
+		old_mask = mask;
+		old_len = len;
+		old_pos = 0;
+		array = new_array;
+		array_alloc = alloc;
+		bits = alloc_bits(new_max_len);
+		max_len = new_max_len;
+		mask = max_len - 1;
+		len = 0;
+		gen++;
+		alloc_ref();
+	}
+
+	/**
+	 * (Re)allocate the referred bits for array, if cap>0.
+	 */
+	void alloc_ref()
+	{
+		if(ref!=NULL)
+			free(ref);
+		ref = NULL;
+		hand = 0;
+		if(cap==0 or array==NULL)
+			return;
+		ref = (uint8_t*)calloc(max_len,1);
+		if(!ref)
+			error("calloc(%lu,1) returned NULL.\n",(uint64_t)max_len);
+	}
+
+	/**
+	 * Move the hashed Atom of keys below dense_len to dense.
+	 */
+	void to_dense()
+	{
+		if(dense_len==0 or len==0 or array==NULL)
+			return;
+		for(ATOM* t=begin();t!=end();)
+		{
+			const K k = t->k & ~LIVING;
+			if(k>=dense_len or (dense<=t and t<dense+dense_len))
+			{
+				t = next(t);
+				continue;
+			}
+			ATOM a = *t;
+			t = erase(t);
+			memcpy(at(k).v,a.v,N*sizeof(T));
+		}
+	}
+
+	/**
+	 * Return dense, allocate it first if NULL.
+	 *
+	 * Several threads may call it at the same time, see insert_shared().
+	 */
+	ATOM* dense_array()
+	{
+		if(dense!=NULL)
+			return dense;
+		ATOM* d = (ATOM*)calloc(dense_len,sizeof(ATOM));
+		if(!d)
+			error("calloc(%lu,%lu) returned NULL.\n",(uint64_t)dense_len,sizeof(ATOM));
+		if(not __sync_bool_compare_and_swap(&dense,(ATOM*)NULL,d))
+			free(d);
+		return dense;
+	}
+
+	/**
+	 * Erase the living Atom of key k in dense.
+	 */
+	void erase_dense(I k)
+	{
+		dense[k].k = 0;
+		memset(dense[k].v,0,N*sizeof(T));
+		dense_count--;
+		gen++;
+	}
+
+	/**
+	 * Return the first living Atom in dense from index k, or NULL if none.
+	 */
+	ATOM* next_dense(I k) const
+	{
+		if(dense==NULL)
+			return NULL;
+		for(;k<dense_len;k++)
+			if(dense[k].k>>SHIFT==3)
+				return dense+k;
+		return NULL;
+	}
+
 public:
 	/**
 	 * Return how many Atom are stored.
 	 */
-	uint32_t size() const { return len; }
+	I size() const { return len+old_len+dense_count; }
 	/**
 	 * Return max number of Atom could be stored.
 	 */
-	uint32_t max_size() const { return max_len; }
+	I max_size() const { return max_len; }
 	
 	/**
 	 * Return number of dead Atom 's body.
+	 *
+	 * Always 0, since erase() leaves no corpse.
 	 */
-	uint32_t vacancies() const { return vacancy; }
+	I vacancies() const { return 0; }
+
+	/**
+	 * Return the generation of the map.
+	 *
+	 * An ATOM* got from find() or operator[] stays valid as long as
+	 * the generation does not change. It changes on rehash, erase, remove
+	 * and clear, not on insertion without rehash.
+	 */
+	uint32_t generation() const { return gen; }
 
 	/**
 	 * Return next Atom after t.
 	 *
 	 * Note that you should not traverse the map while deleting Atom from it.
+	 * (except by erase(), which returns the next one.)
+	 * The dense array goes first, see set_dense().
+	 * When moving, the old array is traversed before the new one.
+	 * The new one is traversed from the slot after head, wrapping around.
 	 */	
 	ATOM* next(ATOM* t) const 
 	{ 
-		do t++; while(t<array+max_len and t->k<(1lu<<63));
-		return t;
+		if(dense!=NULL and dense<=t and t<dense+dense_len)
+		{
+			ATOM* d = next_dense(t-dense+1);
+			return d!=NULL?d:begin_hashed();
+		}
+		if(old!=NULL and old<=t and t<old+old_max_len)
+		{
+			const I i = next_bit(old_bits,t-old+1,old_max_len);
+			if(i<old_max_len)
+				return old+i;
+			t = array+head;
+		}
+		const I index = t-array;
+		if(index<head) // wrapped around
+		{
+			const I i = next_bit(bits,index+1,head);
+			return i<head?array+i:end();
+		}
+		I i = next_bit(bits,index+1,max_len);
+		if(i<max_len)
+			return array+i;
+		i = next_bit(bits,0,head);
+		return i<head?array+i:end();
 	}
 
 	/**
 	 * Return the pointer to the first Atom.
+	 *
+	 * It picks the first empty slot as the head of the traversal.
+	 * No cluster crosses it, so the backward shift of erase() never moves
+	 * an Atom across it. (There is always one, at most 3/4 are used.)
 	 */
-	ATOM* begin() const { return next(array-1); }
+	ATOM* begin() const
+	{
+		for(head=0;head<max_len;head+=64)
+			if(~bits[head>>6]!=0)
+			{
+				head += __builtin_ctzl(~bits[head>>6]);
+				break;
+			}
+		qassert(head<max_len or max_len==0);
+		ATOM* d = next_dense(0);
+		return d!=NULL?d:begin_hashed();
+	}
+
+private:
+	/**
+	 * Return the first Atom of the old and the new array, after begin().
+	 */
+	ATOM* begin_hashed() const
+	{
+		if(old!=NULL)
+		{
+			const I i = next_bit(old_bits,0,old_max_len);
+			if(i<old_max_len)
+				return old+i;
+		}
+		return next(array+head);
+	}
+
+public:
 	/**
 	 * Return the pointer to the last Atom.
 	 */
@@ -208,91 +848,303 @@ public:
 	/**
 	 * Return the reference of Atom of key k or of a blank Atom() if not found.
 	 */
-	const ATOM& get(uint64_t k) const
+	const ATOM& get(uint64_t key) const
 	{
 		static const ATOM null_atom(true);
-		uint32_t index_found;
+		const K k = ATOM::fold(key);
+		if(k<dense_len) // not living is blank
+			return dense!=NULL?dense[k]:null_atom;
+		I index_found;
 		bool found = _find(k,index_found);
 		if(found)
 			return array[index_found];
-		else
-			return null_atom;
+		if(old!=NULL)
+		{
+			ATOM* t = _find_any(k);
+			if(t!=NULL)
+				return *t;
+		}
+		return null_atom;
 	}
 
 	/**
 	 * Find Atom* of key k or return end() if no-found.
 	 */
-	ATOM* find(uint64_t k) const
+	ATOM* find(uint64_t key) const
 	{
-		uint32_t index_found;
+		const K k = ATOM::fold(key);
+		if(k<dense_len)
+			return (dense!=NULL and dense[k].k>>SHIFT==3)?dense+k:end();
+		I index_found;
 		bool found = _find(k,index_found);
 		if(found)
+		{
+			if(ref!=NULL)
+				ref[index_found] = 1;
 			return array+index_found;
-		else
-			return array+max_len;
+		}
+		if(old!=NULL)
+		{
+			ATOM* t = _find_any(k);
+			if(t!=NULL)
+				return t;
+		}
+		return array+max_len;
+	}
+
+	/**
+	 * Prefetch the home slot of key k, for a get() or find() soon.
+	 */
+	inline void prefetch(uint64_t key) const
+	{
+		const K k = ATOM::fold(key);
+		if(k<dense_len)
+		{
+			if(dense!=NULL)
+				__builtin_prefetch(dense+k);
+			return;
+		}
+		__builtin_prefetch(array+home(k,mask));
+		if(old!=NULL)
+			__builtin_prefetch(old+home(k,old_mask));
+	}
+
+	/**
+	 * find() n keys, save the results in a.
+	 *
+	 * The home slots are prefetched PREFETCH_DISTANCE keys ahead,
+	 * so the cache misses of different keys overlap.
+	 */
+	void find_batch(const uint64_t * k, uint32_t n, ATOM ** a) const
+	{
+		for(uint32_t i=0;i<n and i<PREFETCH_DISTANCE;i++)
+			prefetch(k[i]);
+		for(uint32_t i=0;i<n;i++)
+		{
+			if(i+PREFETCH_DISTANCE<n)
+				prefetch(k[i+PREFETCH_DISTANCE]);
+			a[i] = find(k[i]);
+		}
+	}
+
+	/**
+	 * get() n keys, save the results in a. See find_batch().
+	 */
+	void get_batch(const uint64_t * k, uint32_t n, const ATOM ** a) const
+	{
+		for(uint32_t i=0;i<n and i<PREFETCH_DISTANCE;i++)
+			prefetch(k[i]);
+		for(uint32_t i=0;i<n;i++)
+		{
+			if(i+PREFETCH_DISTANCE<n)
+				prefetch(k[i+PREFETCH_DISTANCE]);
+			a[i] = &get(k[i]);
+		}
 	}
 
 	/**
 	 * Get the Atom of key k, Create it if not found.
 	 */
-	ATOM& operator[](uint64_t k)
+	ATOM& operator[](uint64_t k) { return at(ATOM::fold(k)); }
+
+private:
+	/**
+	 * operator[] of a folded key k.
+	 */
+	ATOM& at(K k)
 	{
-		uint32_t index_found, index_new;
+		if(k<dense_len)
+		{
+			ATOM* t = dense_array()+k;
+			if(t->k>>SHIFT!=3)
+			{
+				t->k = k | LIVING;
+				dense_count++;
+			}
+			return *t;
+		}
+		if(old!=NULL)
+		{
+			move_old(inc_step);
+			if(old!=NULL)
+			{
+				I index_old;
+				if(_find(old,old_max_len,old_mask,k,index_old))
+					return *move_one(old+index_old);
+			}
+		}
+		I index_found, index_new;
 		bool found = _find(k,index_found,index_new);
 		if(found)
+		{
+			if(ref!=NULL)
+				ref[index_found] = 1;
 			return array[index_found];
+		}
 		else
 		{
 			// We tries to remember everything
 			// so after a long run with many keys 
-			// it may take a lot of memory
-			if(2*(len+vacancy) > max_len) // overfull
+			// it may take a lot of memory, unless it has a cap
+			if(full())
 			{
-				if(4*len > max_len)
-					rehash(((max_len<1<<24)?4:2)*max_len); // expand
-				else
-					rehash(max_len);
-				return (*this)[k];
+				evict();
+				return at(k);
 			}
-			if(array[index_new].k >> 62 == 1)
-				vacancy--;
-			array[index_new].k = k | (3lu<<62);
+			if(rehash_if_overfull())
+				return at(k);
+			array[index_new].k = k | LIVING;
+			set_bit(index_new);
 			len++;
 			return array[index_new];
 		}
 	}
 
+public:
+	/**
+	 * Whether the next insertion by operator[] would rehash.
+	 */
+	bool overfull() const { return 2*len > max_len; }
+
+	/**
+	 * Rehash if overfull, return whether rehashed.
+	 *
+	 * Expand the map, as it is full of living Atom.
+	 */
+	bool rehash_if_overfull()
+	{
+		if(not overfull())
+			return false;
+		n_rehash++;
+		finish_moving();
+		I new_max_len = ((max_len<1<<24)?4:2)*max_len;
+		if(cap>0 and new_max_len>power2ceil(4*cap)) // enough for cap
+			new_max_len = power2ceil(4*cap);
+		if(inc_step>0 and not borrowed)
+			start_moving(new_max_len);
+		else
+			rehash(new_max_len);
+		return true;
+	}
+
+	/**
+	 * Get the Atom of key k, Create it if not found. (Thread-safe version)
+	 *
+	 * Several threads may call this (and get(), find()) at the same time,
+	 * a free slot is claimed with compare-and-swap on its key.
+	 * It never rehashes. Return NULL if the map is (nearly) full,
+	 * then the caller should rehash it when no other thread is using it.
+	 *
+	 * Note that a slot is only claimed when blank, and k would be found
+	 * before any blank slot, so two threads would never put k in two
+	 * different slots. This is only true when nobody erase() or remove()
+	 * at the same time, which shifts Atom.
+	 */
+	ATOM* insert_shared(uint64_t k)
+	{
+		if(old!=NULL) // k may be in old array, call finish_moving() first
+			return NULL;
+		if(full() and ATOM::fold(k)>=dense_len) // call evict() first
+			return NULL;
+		const K key = ATOM::fold(k);
+		if(key<dense_len)
+		{
+			ATOM* t = dense_array()+key;
+			if(__sync_bool_compare_and_swap(&t->k,(K)0,(K)(key|LIVING)))
+				__sync_fetch_and_add(&dense_count,1);
+			return t;
+		}
+		I count_miss = 0;
+		I index = home(key,mask);
+		while(true)
+		{
+			const K slot = array[index].k;
+			switch((slot>>SHIFT)&3)
+			{
+				case 0: // 0b00 : try to claim it
+					if(4*(uint64_t)len >= 3*(uint64_t)max_len)
+						return NULL;
+					if(__sync_bool_compare_and_swap(&array[index].k,(K)0,(K)(key|LIVING)))
+					{
+						__sync_fetch_and_or(&bits[index>>6],1lu<<(index&63));
+						__sync_fetch_and_add(&len,1);
+						return array+index;
+					}
+					continue; // someone else took it, look again
+				case 3: // 0b11
+					if(slot==(K)(key|LIVING))
+					{
+						if(ref!=NULL)
+							ref[index] = 1;
+						return array+index;
+					}
+					break;
+				default:
+					error("Corrupted Key Head.\n");
+			}
+			count_miss ++;
+			if(count_miss==max_len)
+				return NULL;
+			index = (index+1)&mask;
+		}
+	}
+
 	/**
 	 * Remove an Atom by pointer.
 	 */
 	ATOM* erase(ATOM* t)
 	// erase atom pointed by t
 	{
-		if(not(array<=t and t<array+max_len and t->k>>62==3))
+		if(dense!=NULL and dense<=t and t<dense+dense_len and t->k>>SHIFT==3)
+		{
+			erase_dense(t-dense);
+			return next(t);
+		}
+		if(old!=NULL and old<=t and t<old+old_max_len and t->k>>SHIFT==3)
+		{ // leave the moving to the next operator[], t may be traversed
+			t->k = (t->k & ~LIVING) | CORPSE;
+			memset(t->v,0,N*sizeof(T));
+			old_bits[(t-old)>>6] &= ~(1lu<<((t-old)&63));
+			old_len--;
+			gen++;
+			return next(t);
+		}
+		if(not(array<=t and t<array+max_len and t->k>>SHIFT==3))
 			error("Invalid ATOM* to erase. (%p<=%p<=%p,0x%02lx)\n",
-					array,t,array+max_len,t->k>>62);
-		t->k &= ~(1lu<<63);
-		memset(t->v,0,N*sizeof(float));
-		len--;
-		vacancy++;
+					array,t,array+max_len,(uint64_t)(t->k>>SHIFT));
+		_erase(t-array);
+		if(t->k>>SHIFT==3) // shifted from behind, not visited yet
+			return t;
 		return next(t);
 	}
 
 	/**
 	 * Remove an Atom by key.
 	 */
-	bool remove(uint64_t k)
+	bool remove(uint64_t key)
 	// remove key k, return if successful
 	{
-		uint32_t index_found;
-		bool found = _find(k,index_found);
-		if(found)
+		const K k = ATOM::fold(key);
+		if(k<dense_len)
 		{
-			array[index_found].k &= ~(1lu<<63);
-			memset(array[index_found].v,0,N*sizeof(float));
-			len--;
-			vacancy++;
+			if(dense==NULL or dense[k].k>>SHIFT!=3)
+				return false;
+			erase_dense(k);
+			return true;
 		}
+		if(old!=NULL)
+		{
+			move_old(inc_step);
+			ATOM* t = _find_any(k);
+			if(t==NULL)
+				return false;
+			erase(t);
+			return true;
+		}
+		I index_found;
+		bool found = _find(k,index_found);
+		if(found)
+			_erase(index_found);
 		return found;
 	}
 
@@ -303,10 +1155,26 @@ public:
 	 */
 	void clear()
 	{
+		if(ref!=NULL)
+			memset(ref,0,max_len);
+		if(old!=NULL)
+		{
+			big_free(old,(uint64_t)old_max_len*sizeof(ATOM),old_alloc);
+			free(old_bits);
+			old = NULL;
+			old_bits = NULL;
+			old_max_len = old_len = old_mask = old_pos = 0;
+		}
 		if(len!=0)
+		{
 			memset(array,0,max_len*sizeof(ATOM));
+			memset(bits,0,bitmap_words(max_len)*sizeof(uint64_t));
+		}
+		if(dense!=NULL)
+			memset(dense,0,dense_len*sizeof(ATOM));
+		dense_count = 0;
 		len = 0;
-		vacancy = 0;
+		gen++;
 	}
 
 	/**
@@ -316,26 +1184,42 @@ public:
 	 * If array is NULL, this will make a new valid map.
 	 * Else, it will transfer everything to a new map.
 	 */
-	void rehash(uint32_t new_max_len)
+	void rehash(I new_max_len)
 	{
 		qassert(new_max_len!=0);
 		if(array==NULL)
 		{
 			max_len = new_max_len;
-			len = 0; // normally we don't need to reinit len and vacancy
-			vacancy = 0;
+			len = 0; // normally we don't need to reinit len
 			mask = max_len - 1;
-			array = (ATOM*)malloc(max_len*sizeof(ATOM));
+			borrowed = false;
+			array = (ATOM*)big_alloc((uint64_t)max_len*sizeof(ATOM),alloc);
 			if(!array)
-				error("malloc(%u*%lu) returned NULL.\n",max_len,sizeof(ATOM));
-			memset(array,0,max_len*sizeof(ATOM));
+				error("big_alloc(%lu*%lu) returned NULL.\n",(uint64_t)max_len,sizeof(ATOM));
+			array_alloc = alloc;
+			bits = alloc_bits(max_len);
+			alloc_ref();
 			return;
 		}
+		finish_moving();
 		// make new map
-		BigMap newm(new_max_len);
+		BigMap newm;
+		newm.alloc = alloc;
+		newm.rehash(new_max_len);
+		newm.gen = gen+1;
+		newm.inc_step = inc_step;
+		newm.cap = cap;
+		newm.n_evicted = n_evicted;
+		newm.n_rehash = n_rehash;
+		newm.alloc_ref();
+		newm.dense_len = dense_len;
+		newm.dense_count = dense_count;
+		newm.dense = dense; // so only the hashed Atom are traversed below
+		dense = NULL;
+		dense_count = 0;
 		if(len!=0)
 			for(ATOM* t=begin();t!=end();t=next(t))
-				memcpy(newm[t->k].v,t->v,N*sizeof(T)); // only copy v[N]
+				memcpy(newm.at(t->k&~LIVING).v,t->v,N*sizeof(T)); // only copy v[N]
 		// swap
 		char * buffer = (char*)malloc(sizeof(*this));
 		qassert(buffer!=NULL);
@@ -345,20 +1229,93 @@ public:
 		free(buffer);
 	}
 
+	/**
+	 * Tag of the layout of the image written by dump().
+	 *
+	 * (1 was the quadratic probing with corpses, 3 had no bitmap.)
+	 */
+	static uint32_t layout() { return 4; }
+
+	/**
+	 * Bytes of the image of a map of _max_len, see dump().
+	 *
+	 * The array, followed by the occupancy bitmap,
+	 * then the _dense Atom of dense_size().
+	 */
+	static uint64_t image_size(I _max_len, I _dense = 0)
+	{
+		return (uint64_t)_max_len*sizeof(ATOM) + bitmap_words(_max_len)*sizeof(uint64_t)
+			+ (uint64_t)_dense*sizeof(ATOM);
+	}
+
+	/**
+	 * Write the array as it is to a (opened) file, return bytes written.
+	 *
+	 * With max_size(), size() and dense_size(), it can be used
+	 * in place by link().
+	 */
+	uint64_t dump(FILE * fo)
+	{
+		finish_moving();
+		qassert(max_len==fwrite(array,sizeof(ATOM),max_len,fo));
+		qassert(bitmap_words(max_len)==fwrite(bits,sizeof(uint64_t),bitmap_words(max_len),fo));
+		if(dense!=NULL)
+			qassert(dense_len==fwrite(dense,sizeof(ATOM),dense_len,fo));
+		return image_size(max_len,dense_size());
+	}
+
+	/**
+	 * Use an image written by dump() in place.
+	 *
+	 * Discard everything previously stored in the map if any.
+	 * mem should hold image_size(_max_len) bytes, aligned as ATOM,
+	 * and stay valid as long as the map uses it. It is written by operator[]
+	 * and erase(), so map it with MAP_PRIVATE to keep the file unchanged.
+	 * It is not freed, and a rehash moves the map to a new array.
+	 * (Thus it always rehashes at once, see set_incremental().)
+	 * The _dense Atom are copied, to where set_dense() of this map
+	 * puts them. _dense_len is the n of set_dense() when it was dumped.
+	 */
+	void link(void * mem, I _max_len, I _len, I _vacancy,
+			I _dense = 0, I _dense_len = 0)
+	{
+		qassert(_max_len!=0 and (_max_len&(_max_len-1))==0);
+		qassert(_vacancy==0);
+		dtor();
+		array = (ATOM*)mem;
+		bits = (uint64_t*)(array+_max_len);
+		borrowed = true;
+		max_len = _max_len;
+		mask = max_len - 1;
+		len = _len;
+		gen++;
+		alloc_ref();
+		const ATOM* d = (const ATOM*)((char*)mem + image_size(_max_len));
+		for(I k=0;k<_dense;k++)
+			if(d[k].k>>SHIFT==3)
+				len--;
+		qassert(len<max_len);
+		for(I k=0;k<_dense;k++)
+			if(d[k].k>>SHIFT==3)
+				memcpy(at(k).v,d[k].v,N*sizeof(T));
+		if(dense_len>_dense_len) // some keys below dense_len were hashed
+			to_dense();
+	}
+
 	/**
 	 * Save the map to a (opened) file.
 	 */
-	uint32_t save(FILE * fo) const
+	I save(FILE * fo) const
 	{
-		fprintf(fo,"map_size: %u\n",len);
+		fprintf(fo,"map_size: %lu\n",(uint64_t)size());
 		for(auto t=begin();t!=end();t=next(t))
 		{
-			fprintf(fo,"0x%0lx",t->k & ~(3lu<<62));
+			fprintf(fo,"0x%0lx",(uint64_t)(t->k & ~LIVING));
 			for(uint32_t i=0;i<N;i++)
-				fprintf(fo,"\t%10e",t->v[i]);
+				fprintf(fo,"\t%10e",(double)t->v[i]);
 			fprintf(fo,"\n");
 		}
-		return len;
+		return size();
 	}
 
 	/**
@@ -366,27 +1323,29 @@ public:
 	 *
 	 * Discard everything previously stored in the map if any.
 	 */
-	uint32_t load(FILE * fi)
+	I load(FILE * fi)
 	{
-		uint32_t new_len;
-		qassert(1==fscanf(fi,"map_size: %u\n",&new_len));
+		uint64_t new_len;
+		qassert(1==fscanf(fi,"map_size: %lu\n",&new_len));
 		dtor();
 		rehash(power2ceil(4*new_len));
-		for(uint32_t i=0;i<new_len;i++)
+		for(I i=0;i<new_len;i++)
 		{
 			uint64_t k;
 			qassert(1==fscanf(fi,"0x%lx",&k));
 			ATOM& t = (*this)[k];
 			for(uint32_t i=0;i<N;i++)
 			{
-				qassert(1==fscanf(fi,"\t%e",&t.v[i]));
-				if(!std::isfinite(t.v[i]))
+				float v;
+				qassert(1==fscanf(fi,"\t%e",&v));
+				if(!std::isfinite(v))
 					error("(*0x%p)[0x%lx].v[%u] = %f, isfinite Failed.\n",
-							this,k&~(3lu<<62),i,t.v[i]);
+							this,(uint64_t)ATOM::fold(k),i,v);
+				t.v[i] = v;
 			}
 			qassert('\n'==fgetc(fi));
 		}
-		return len;
+		return size();
 	}
 
 };
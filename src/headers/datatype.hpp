@@ -68,6 +68,18 @@ public:
 		x[len++] = f;
 	}
 
+	/**
+	 * Make room for at least n Feature.
+	 */
+	inline void reserve(uint32_t n)
+	{
+		if(n<=max_len)
+			return;
+		while(max_len<n)
+			max_len *= 2;
+		qassert((x = (Feature*)realloc(x,max_len*sizeof(Feature))));
+	}
+
 	/**
 	 * Remove all the Feature.
 	 */
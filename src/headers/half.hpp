@@ -0,0 +1,201 @@
+/**
+ * @file half.hpp
+ * @brief 16-bit floats (fp16, bf16) for weights, and stochastic rounding.
+ * @author linus
+ * @version 1.0
+ * @date 2013-10-03
+ */
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+
+#include "headers/lcg64.hpp"
+
+static __thread uint64_t __sround_r = 0; // one generator per thread, see sround()
+
+/**
+ * 32 random bits for stochastic rounding.
+ *
+ * It has a generator of its own, so rounding does not change
+ * the sequence of lcg64() used elsewhere.
+ */
+inline uint32_t sround()
+{
+	__sround_r = __sround_r*A_Default + 1;
+	return (uint32_t)(__sround_r>>32);
+}
+
+/**
+ * IEEE 754 half precision: 1 sign, 5 exponent and 10 fraction bits.
+ *
+ * About 3 decimal digits in [6e-5,65504], and down to 6e-8 as subnormals.
+ * Larger values saturate at 65504. All bits 0 is 0, so Atom of it can
+ * be initialized by memset.
+ */
+class fp16
+{
+public:
+	uint16_t bits;
+
+	fp16() = default;
+	/**
+	 * Round x to the nearest.
+	 */
+	fp16(float x): bits(round(x,0,false)) {}
+
+	operator float() const
+	{
+		const uint32_t sign = (uint32_t)(bits&0x8000)<<16;
+		const uint32_t e = (bits>>10)&0x1f;
+		uint32_t m = bits&0x3ff;
+		uint32_t u;
+		if(e==0x1f) // inf, nan
+			u = sign | 0x7f800000 | (m<<13);
+		else if(e!=0)
+			u = sign | ((e+112)<<23) | (m<<13);
+		else if(m==0)
+			u = sign;
+		else // subnormal, normalize it
+		{
+			uint32_t s = 0;
+			while((m&0x400)==0)
+			{
+				m <<= 1;
+				s++;
+			}
+			u = sign | ((113-s)<<23) | ((m&0x3ff)<<13);
+		}
+		float x;
+		memcpy(&x,&u,sizeof(x));
+		return x;
+	}
+
+	/**
+	 * Round x up (away from 0) with the probability of its distance
+	 * from the value below, using the random bits r.
+	 */
+	static fp16 stochastic(float x, uint32_t r)
+	{
+		fp16 h;
+		h.bits = round(x,r,true);
+		return h;
+	}
+
+private:
+	/**
+	 * Bits of x rounded to nearest even, or stochastically by r.
+	 */
+	static uint16_t round(float x, uint32_t r, bool stochastic)
+	{
+		uint32_t u;
+		memcpy(&u,&x,sizeof(u));
+		const uint16_t sign = (u>>16)&0x8000;
+		const uint32_t a = u&0x7fffffff;
+		if(a>0x7f800000) // nan
+			return sign | 0x7e00;
+		if(a>=0x477ff000) // 65504 and above, inf
+			return sign | 0x7bff;
+		const int32_t e = (int32_t)(a>>23) - 127;
+		if(e < -25) // below half of the least subnormal
+			return sign;
+		uint32_t m = (a&0x7fffff) | 0x800000;
+		uint32_t shift = 13;
+		uint32_t h;
+		if(e >= -14)
+			h = ((uint32_t)(e+15)<<10) | ((m>>13)&0x3ff);
+		else
+		{
+			shift = 13 + (-14-e);
+			h = m>>shift;
+		}
+		const uint32_t rest = m & ((1u<<shift)-1);
+		const uint32_t half = 1u<<(shift-1);
+		bool up;
+		if(stochastic)
+			up = (r & ((1u<<shift)-1)) < rest;
+		else
+			up = rest>half or (rest==half and (h&1));
+		h += up; // a carry goes into the exponent, as it should
+		return sign | (h<0x7c00?h:0x7bff);
+	}
+};
+
+/**
+ * bfloat16: the upper 16 bits of a float.
+ *
+ * The same range as float with 8 fraction bits, about 2 decimal digits.
+ */
+class bf16
+{
+public:
+	uint16_t bits;
+
+	bf16() = default;
+	/**
+	 * Round x to the nearest.
+	 */
+	bf16(float x)
+	{
+		uint32_t u;
+		memcpy(&u,&x,sizeof(u));
+		if((u&0x7fffffff)>0x7f800000) // nan
+			bits = (u>>16)|0x40;
+		else
+			bits = (u + 0x7fff + ((u>>16)&1))>>16;
+	}
+
+	operator float() const
+	{
+		const uint32_t u = (uint32_t)bits<<16;
+		float x;
+		memcpy(&x,&u,sizeof(x));
+		return x;
+	}
+
+	/**
+	 * Round x away from 0 with the probability of its distance
+	 * from the value below, using the random bits r.
+	 */
+	static bf16 stochastic(float x, uint32_t r)
+	{
+		uint32_t u;
+		memcpy(&u,&x,sizeof(u));
+		bf16 h;
+		if((u&0x7fffffff)>=0x7f800000) // inf, nan
+			h.bits = u>>16;
+		else
+			h.bits = (u + (r&0xffff))>>16;
+		return h;
+	}
+};
+
+/**
+ * Store x in a value v.
+ *
+ * A float is rounded to the nearest as usual. A 16-bit float is rounded
+ * stochastically, so its expectation is x: an update much smaller than
+ * the gap between two values of v moves v once in a while, instead of
+ * being lost every time. (fp16 has a gap of 1/1024 at 1, bf16 of 1/128.)
+ */
+inline void store(float& v, double x) { v = x; }
+inline void store(double& v, double x) { v = x; }
+inline void store(fp16& v, double x) { v = fp16::stochastic(x,sround()); }
+inline void store(bf16& v, double x) { v = bf16::stochastic(x,sround()); }
+
+/**
+ * Scale of the int8 quantization of weights in [-max_abs,max_abs].
+ *
+ * A weight w is served as scale*q, q = to_int8(w,scale) in [-127,127].
+ */
+inline float int8_scale(float max_abs) { return max_abs>0?max_abs/127:1; }
+
+/**
+ * Quantize weight w to int8 by scale, rounding to the nearest.
+ */
+inline int8_t to_int8(float w, float scale)
+{
+	const float q = rintf(w/scale);
+	return (int8_t)(q>127?127:(q<-127?-127:q));
+}
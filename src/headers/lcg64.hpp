@@ -15,7 +15,7 @@
 #define A_LEcuyer2 (3202034522624059733ull)
 #define A_LEcuyer3 (3935559000370003845ull)
 
-static uint64_t __lcg64_r = 0;
+static __thread uint64_t __lcg64_r = 0; // one generator per thread
 
 inline uint64_t lcg64(void)
 {
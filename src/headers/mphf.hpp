@@ -0,0 +1,197 @@
+/**
+ * @file mphf.hpp
+ * @brief Minimal perfect hash function of a fixed set of 64-bit keys.
+ * @author linus
+ * @version 1.0
+ * @date 2013-10-03
+ */
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include "headers/hash.hpp"
+#include "headers/error.hpp"
+
+#define MPHF_LAMBDA 5 ///< keys per bucket on average
+#define MPHF_ALPHA 0.98 ///< keys per position, see MPHF
+#define MPHF_MAX_PILOT 65535 ///< the largest pilot
+
+/**
+ * Minimal perfect hash function, mapping n distinct keys to [0,n).
+ *
+ * See [PTHash: Revisiting FCH Minimal Perfect Hashing](https://arxiv.org/abs/2104.10402).
+ * A key goes to a bucket by its high bits, MPHF_LAMBDA keys in a bucket
+ * on average, and a bucket has a pilot p so that its keys go to
+ * positions fmix(key+p*C) of [0,n/MPHF_ALPHA) not taken by other
+ * buckets. The positions from n are taken by few keys, they are
+ * remapped to the free ones below n.
+ *
+ * So a lookup reads the pilot of its bucket, 2 bytes per MPHF_LAMBDA keys
+ * (about 6.4 MB for 16M keys, not always in cache), and for about 2% of
+ * the keys a remap after it. A key not in the set goes to some position
+ * too, the caller should check, e.g. by a fingerprint.
+ * The keys should be well mixed, e.g. by fmix().
+ */
+class MPHF
+{
+protected:
+	uint64_t n; ///< number of keys
+	uint64_t n_bucket; ///< number of buckets
+	uint64_t m; ///< number of positions, n/MPHF_ALPHA
+	const uint16_t* pilot; ///< pilot of each bucket
+	const uint32_t* remap; ///< position below n for each position from n
+	std::vector<uint16_t> own_pilot; ///< pilot, if built here
+	std::vector<uint32_t> own_remap; ///< remap, if built here
+
+public:
+	MPHF(): n(0), n_bucket(0), m(0), pilot(NULL), remap(NULL) {}
+
+	/**
+	 * Return the number of keys.
+	 */
+	uint64_t size() const { return n; }
+	/**
+	 * Return the number of buckets, thus pilots.
+	 */
+	uint64_t buckets() const { return n_bucket; }
+	/**
+	 * Return the number of positions before remapping.
+	 */
+	uint64_t positions() const { return m; }
+	/**
+	 * Return the pilots.
+	 */
+	const uint16_t* pilots() const { return pilot; }
+	/**
+	 * Return the remap of the positions from n.
+	 */
+	const uint32_t* remaps() const { return remap; }
+
+	/**
+	 * Bucket of key h.
+	 */
+	inline uint64_t bucket(uint64_t h) const
+	{
+		return (uint64_t)(((__uint128_t)h*n_bucket)>>64);
+	}
+
+	/**
+	 * Prefetch the pilot of key h.
+	 */
+	inline void prefetch(uint64_t h) const { __builtin_prefetch(pilot+bucket(h)); }
+
+	/**
+	 * Position of key h in [0,n), or any of them if h is not a key.
+	 */
+	inline uint64_t operator()(uint64_t h) const
+	{
+		const uint64_t p = position(h,pilot[bucket(h)]);
+		return p<n?p:remap[p-n];
+	}
+
+	/**
+	 * Build it for n distinct keys.
+	 *
+	 * The buckets are placed from the largest, each with its least pilot.
+	 * Two equal keys can never be placed, so they are an error().
+	 */
+	void build(const uint64_t* key, uint64_t _n)
+	{
+		n = _n;
+		n_bucket = std::max<uint64_t>(1,(n+MPHF_LAMBDA-1)/MPHF_LAMBDA);
+		m = std::max<uint64_t>(n,(uint64_t)ceil(n/MPHF_ALPHA));
+		qassert(m<(1lu<<32));
+		// sort the keys by bucket
+		std::vector<uint32_t> start(n_bucket+1,0);
+		for(uint64_t i=0;i<n;i++)
+			start[bucket(key[i])+1]++;
+		for(uint64_t b=0;b<n_bucket;b++)
+			start[b+1] += start[b];
+		std::vector<uint64_t> sorted(n);
+		std::vector<uint32_t> cursor(start.begin(),start.end()-1);
+		for(uint64_t i=0;i<n;i++)
+			sorted[cursor[bucket(key[i])]++] = key[i];
+		std::vector<uint32_t> order(n_bucket);
+		for(uint64_t b=0;b<n_bucket;b++)
+			order[b] = b;
+		std::stable_sort(order.begin(),order.end(),
+				[&start](uint32_t a, uint32_t b)
+				{ return start[a+1]-start[a]>start[b+1]-start[b]; });
+		// place the buckets
+		std::vector<uint64_t> taken((m+63)/64,0);
+		std::vector<uint64_t> pos;
+		own_pilot.assign(n_bucket,0);
+		for(auto b: order)
+		{
+			const uint64_t* k = &sorted[0]+start[b];
+			const uint32_t len = start[b+1]-start[b];
+			if(len==0)
+				break;
+			for(uint32_t i=1;i<len;i++)
+				for(uint32_t j=0;j<i;j++)
+					if(k[i]==k[j])
+						error("MPHF: key 0x%lx is given twice.\n",k[i]);
+			for(uint32_t p=0;;p++)
+			{
+				if(p>MPHF_MAX_PILOT)
+					error("MPHF: no pilot for a bucket of %u keys.\n",len);
+				pos.clear();
+				for(uint32_t i=0;i<len;i++)
+				{
+					const uint64_t q = position(k[i],p);
+					if((taken[q/64]>>(q%64))&1 or
+							std::find(pos.begin(),pos.end(),q)!=pos.end())
+						break;
+					pos.push_back(q);
+				}
+				if(pos.size()<len)
+					continue;
+				for(auto q: pos)
+					taken[q/64] |= 1lu<<(q%64);
+				own_pilot[b] = p;
+				break;
+			}
+		}
+		// remap the positions from n to the free ones
+		own_remap.assign(m-n,0);
+		uint64_t free = 0;
+		for(uint64_t q=n;q<m;q++)
+		{
+			if(not ((taken[q/64]>>(q%64))&1))
+				continue;
+			while((taken[free/64]>>(free%64))&1)
+				free++;
+			own_remap[q-n] = free++;
+		}
+		pilot = own_pilot.data();
+		remap = own_remap.data();
+	}
+
+	/**
+	 * Use pilots and remaps kept elsewhere, e.g. in a mapped file.
+	 */
+	void link(uint64_t _n, uint64_t _n_bucket, uint64_t _m,
+			const uint16_t* _pilot, const uint32_t* _remap)
+	{
+		n = _n;
+		n_bucket = _n_bucket;
+		m = _m;
+		pilot = _pilot;
+		remap = _remap;
+		own_pilot.clear();
+		own_remap.clear();
+	}
+
+protected:
+	/**
+	 * Position of key h in [0,m) with pilot p.
+	 */
+	inline uint64_t position(uint64_t h, uint64_t p) const
+	{
+		return (uint64_t)(((__uint128_t)fmix(h+p*0x9e3779b97f4a7c15lu)*m)>>64);
+	}
+};
@@ -0,0 +1,162 @@
+/**
+ * @file ring.hpp
+ * @brief A bounded lock-free queue of Sample.
+ * @author linus
+ * @version 1.0
+ * @date 2013-10-03
+ */
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+extern "C"
+{
+#include <sched.h>
+}
+
+#include "headers/error.hpp"
+#include "headers/datatype.hpp"
+#include "headers/bigmap2.hpp"
+
+/**
+ * A bounded Single-Producer/Single-Consumer ring buffer of Sample.
+ *
+ * All the Sample slots are allocated in the constructor and reused,
+ * so the producer fills a slot in place and the consumer reads it in place.
+ * No lock is used, head and tail are published with acquire/release.
+ *
+ * It also counts how often each side has to wait for the other,
+ * and the occupancy seen by the consumer, to tell which side is slower.
+ */
+class SampleRing
+{
+private:
+	const uint32_t n; ///< number of slots. Should be in the power of 2
+	const uint32_t mask; ///< n-1
+	Sample* slot; ///< the slots
+	char pad0[64]; ///< keep the two sides in different cache lines
+	uint64_t head; ///< number of Sample read, written by consumer
+public:
+	uint64_t n_empty; ///< times the consumer found the ring empty
+	uint64_t sum_occupancy; ///< sum of occupancy seen by the consumer
+private:
+	char pad1[64];
+	uint64_t tail; ///< number of Sample written, written by producer
+public:
+	uint64_t n_full; ///< times the producer found the ring full
+private:
+	char pad2[64];
+
+public:
+
+	/**
+	 * Constructor
+	 *
+	 * @param _n number of slots, rounded up to the power of 2
+	 * @param sample_len initial max_len of each Sample
+	 */
+	SampleRing(uint32_t _n, uint32_t sample_len = 512):
+		n(power2ceil(_n)), mask(n-1), slot(NULL), head(0),
+		n_empty(0), sum_occupancy(0), tail(0), n_full(0)
+	{
+		slot = (Sample*)malloc(n*sizeof(Sample));
+		if(!slot)
+			error("malloc(%u*%lu) returned NULL.\n",n,sizeof(Sample));
+		for(uint32_t i=0;i<n;i++)
+			new(slot+i) Sample(sample_len);
+	}
+
+	~SampleRing()
+	{
+		if(slot==NULL)
+			return;
+		for(uint32_t i=0;i<n;i++)
+			slot[i].~Sample();
+		free(slot);
+		slot = NULL;
+	}
+
+	/**
+	 * Number of slots.
+	 */
+	uint32_t max_size() const { return n; }
+
+	/**
+	 * Number of Sample written but not read yet.
+	 */
+	uint32_t size() const
+	{
+		return __atomic_load_n(&tail,__ATOMIC_ACQUIRE)
+			- __atomic_load_n(&head,__ATOMIC_ACQUIRE);
+	}
+
+	/**
+	 * (Producer) Return the slot to fill, or NULL if full.
+	 */
+	Sample* try_push()
+	{
+		if(tail - __atomic_load_n(&head,__ATOMIC_ACQUIRE) == n)
+			return NULL;
+		return slot + (tail&mask);
+	}
+
+	/**
+	 * (Producer) Return the slot to fill, wait while full.
+	 *
+	 * Give up and return NULL if *stop becomes true.
+	 */
+	Sample* push(volatile bool* stop)
+	{
+		Sample* s = try_push();
+		if(s!=NULL)
+			return s;
+		n_full++;
+		while(NULL==(s=try_push()))
+		{
+			if(*stop)
+				return NULL;
+			sched_yield();
+		}
+		return s;
+	}
+
+	/**
+	 * (Producer) Publish the slot returned by push().
+	 */
+	void commit_push()
+	{
+		__atomic_store_n(&tail,tail+1,__ATOMIC_RELEASE);
+	}
+
+	/**
+	 * (Consumer) Return the oldest Sample, or NULL if empty.
+	 */
+	Sample* try_pop()
+	{
+		const uint64_t t = __atomic_load_n(&tail,__ATOMIC_ACQUIRE);
+		if(t == head)
+			return NULL;
+		sum_occupancy += t - head;
+		return slot + (head&mask);
+	}
+
+	/**
+	 * (Consumer) Release the slot returned by try_pop() for reuse.
+	 */
+	void commit_pop()
+	{
+		__atomic_store_n(&head,head+1,__ATOMIC_RELEASE);
+	}
+
+	/**
+	 * Number of Sample read.
+	 */
+	uint64_t n_pop() const { return head; }
+
+private:
+	SampleRing(const SampleRing&);
+	SampleRing& operator=(const SampleRing&);
+};
+
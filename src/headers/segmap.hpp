@@ -0,0 +1,584 @@
+/**
+ * @file segmap.hpp
+ * @brief A HashMap of BigMap segments, which grow one at a time.
+ * @author linus
+ * @version 1.0
+ * @date 2013-10-03
+ */
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include "headers/error.hpp"
+#include "headers/hash.hpp"
+#include "headers/bigmap2.hpp"
+
+#define SEGMAP_MIN_LEN 64 ///< min max_size() of a segment
+
+/**
+ * Head of the image of a segment, see SegMap::dump().
+ */
+typedef struct
+{
+	uint64_t max_len; ///< max_size() of the segment
+	uint64_t len; ///< size() of the segment
+	uint64_t dense; ///< dense_size() of the segment
+	uint64_t dense_len; ///< dense_limit() of the segment
+	uint64_t reserved[4]; ///< 0
+} SegHead;
+
+/**
+ * A HashMap made of S BigMap segments.
+ *
+ * A key goes to the segment picked by the top bits of its fmix(), and
+ * each segment is a BigMap of its own, which grows when it is overfull.
+ * So when BigMap grows, it needs the old and the new array at the
+ * same time, 5 times the array in all (3 times above 1<<24 slots),
+ * while SegMap needs that only for one segment: 1+4/S times the array.
+ * A 16 GB table of S=16 grows with 4 GB more, instead of 64 GB more.
+ * The set_incremental() of BigMap does not help here, it keeps both
+ * arrays until the moving is done.
+ *
+ * The price is a second hash of each key to pick the segment, and
+ * a little imbalance: the segments are of 2 or 3 sizes while growing.
+ * Each segment has at least SEGMAP_MIN_LEN slots, so a small map takes
+ * more memory than a BigMap.
+ *
+ * It has the same interface as BigMap, so LR_Learner_T and Feeder can use
+ * it instead. The cap is split evenly to the segments, and overfull()
+ * is true if any segment is, so a lazy learner settles before any of
+ * them grows. The traversal goes through the segments in turn.
+ * The keys below the n of set_dense() all go to segment 0, which keeps
+ * them in its dense array.
+ * I is the index type of the segments, see BigMap. The counts of
+ * the whole map are in uint64_t. K is the type of the stored keys,
+ * a key is folded (see Atom::fold()) before its segment is picked.
+ */
+template <unsigned N, typename T, unsigned S = 16, typename I = uint32_t,
+		typename K = uint64_t>
+class SegMap
+{
+public:
+	typedef BigMap<N,T,I,K> MAP;
+	typedef typename MAP::ATOM ATOM;
+
+private:
+	MAP seg[S]; ///< segments
+	uint32_t gen; ///< generation, changed when any segment changes its own
+	uint64_t cap; ///< max number of Atom in all, 0 for no limit
+	uint64_t dense_len; ///< keys below it go to seg[0], see set_dense()
+
+	static_assert(S>0 and (S&(S-1))==0, "S should be in the power of 2");
+
+	/**
+	 * Segment of a folded key k. (the state bits are ignored)
+	 */
+	inline uint32_t segment(K k) const
+	{
+		const uint64_t key = k & ~ATOM::STATE;
+		if(S==1 or key<dense_len)
+			return 0;
+		return (uint32_t)(fmix(key) >> (64-__builtin_ctz(S)));
+	}
+
+	/**
+	 * Move each Atom not in its segment to there.
+	 */
+	void relocate()
+	{
+		for(uint32_t s=0;s<S;s++)
+			for(auto t=seg[s].begin();t!=seg[s].end();)
+			{
+				const K k = t->k & ~ATOM::STATE;
+				const uint32_t r = segment(k);
+				if(r==s)
+				{
+					t = seg[s].next(t);
+					continue;
+				}
+				memcpy(seg[r][k].v,t->v,N*sizeof(T));
+				t = seg[s].erase(t);
+			}
+		gen++;
+	}
+
+	/**
+	 * The first Atom of the segments after s, or end().
+	 */
+	ATOM* begin_after(uint32_t s) const
+	{
+		for(s++;s<S;s++)
+		{
+			ATOM* t = seg[s].begin();
+			if(t!=seg[s].end())
+				return t;
+		}
+		return end();
+	}
+
+public:
+	SegMap(): gen(0), cap(0), dense_len(0) {}
+
+	SegMap(uint64_t _max_len): gen(0), cap(0), dense_len(0) { rehash(_max_len); }
+
+	~SegMap() {dtor();}
+
+	void dtor()
+	{
+		for(uint32_t s=0;s<S;s++)
+			seg[s].dtor();
+	}
+
+	/**
+	 * Print (for debug)
+	 */
+	inline void print() const
+	{
+		for(uint32_t s=0;s<S;s++)
+		{
+			printf("segment %u: ",s);
+			seg[s].print();
+		}
+	}
+
+	/**
+	 * See BigMap::set_incremental().
+	 */
+	void set_incremental(uint32_t step)
+	{
+		for(uint32_t s=0;s<S;s++)
+			seg[s].set_incremental(step);
+	}
+
+	/**
+	 * See BigMap::set_alloc().
+	 */
+	void set_alloc(uint32_t policy)
+	{
+		for(uint32_t s=0;s<S;s++)
+			seg[s].set_alloc(policy);
+	}
+
+	/**
+	 * Keep the keys below n in the dense array of segment 0,
+	 * see BigMap::set_dense().
+	 */
+	void set_dense(uint64_t n)
+	{
+		if(n==dense_len)
+			return;
+		dense_len = n;
+		seg[0].set_dense(n);
+		if(size()>0)
+			relocate();
+		gen++;
+	}
+
+	/**
+	 * Number of Atom of the dense array, 0 if not allocated.
+	 */
+	uint64_t dense_size() const { return seg[0].dense_size(); }
+
+	/**
+	 * The n of set_dense().
+	 */
+	uint64_t dense_limit() const { return dense_len; }
+
+	/**
+	 * Keep at most _cap Atom, about _cap/S in each segment. (0 for no limit)
+	 */
+	void set_cap(uint64_t _cap)
+	{
+		cap = _cap;
+		for(uint32_t s=0;s<S;s++)
+		{
+			const uint32_t g = seg[s].generation();
+			const I c = cap/S+(s<cap%S);
+			seg[s].set_cap(cap>0 and c==0?1:c); // 0 would be no limit
+			if(seg[s].generation()!=g)
+				gen++;
+		}
+	}
+
+	/**
+	 * Whether any segment keeps as many Atom as its cap.
+	 */
+	bool full() const
+	{
+		for(uint32_t s=0;s<S;s++)
+			if(seg[s].full())
+				return true;
+		return false;
+	}
+
+	/**
+	 * Number of Atom evicted so far.
+	 */
+	uint64_t evictions() const
+	{
+		uint64_t n = 0;
+		for(uint32_t s=0;s<S;s++)
+			n += seg[s].evictions();
+		return n;
+	}
+
+	/**
+	 * Number of rehash of the segments done because they were overfull.
+	 */
+	uint32_t rehashes() const
+	{
+		uint32_t n = 0;
+		for(uint32_t s=0;s<S;s++)
+			n += seg[s].rehashes();
+		return n;
+	}
+
+	/**
+	 * Evict about n Atom, n/S+1 from each full segment, see BigMap::evict().
+	 */
+	void evict(uint64_t n = 1)
+	{
+		for(uint32_t s=0;s<S;s++)
+			if(seg[s].full())
+				seg[s].evict(n/S+1);
+		gen++;
+	}
+
+	/**
+	 * Whether any segment is moving, see BigMap::moving().
+	 */
+	bool moving() const
+	{
+		for(uint32_t s=0;s<S;s++)
+			if(seg[s].moving())
+				return true;
+		return false;
+	}
+
+	/**
+	 * Move everything left in the old array of each segment.
+	 */
+	void finish_moving()
+	{
+		for(uint32_t s=0;s<S;s++)
+			if(seg[s].moving())
+			{
+				seg[s].finish_moving();
+				gen++;
+			}
+	}
+
+	/**
+	 * Return how many Atom are stored.
+	 */
+	uint64_t size() const
+	{
+		uint64_t n = 0;
+		for(uint32_t s=0;s<S;s++)
+			n += seg[s].size();
+		return n;
+	}
+
+	/**
+	 * Return max number of Atom could be stored, in all the segments.
+	 */
+	uint64_t max_size() const
+	{
+		uint64_t n = 0;
+		for(uint32_t s=0;s<S;s++)
+			n += seg[s].max_size();
+		return n;
+	}
+
+	/**
+	 * Return number of dead Atom 's body. (Always 0, see BigMap.)
+	 */
+	uint64_t vacancies() const { return 0; }
+
+	/**
+	 * Return the generation of the map, see BigMap::generation().
+	 */
+	uint32_t generation() const { return gen; }
+
+	/**
+	 * Return next Atom after t, see BigMap::next().
+	 */
+	ATOM* next(ATOM* t) const
+	{
+		const uint32_t s = segment(t->k);
+		t = seg[s].next(t);
+		return t==seg[s].end() ? begin_after(s) : t;
+	}
+
+	/**
+	 * Return the pointer to the first Atom.
+	 */
+	ATOM* begin() const { return begin_after(~0u); }
+
+	/**
+	 * Return the pointer to the last Atom.
+	 */
+	ATOM* end() const { return seg[S-1].end(); }
+
+	/**
+	 * Return the reference of Atom of key k or of a blank Atom() if not found.
+	 */
+	const ATOM& get(uint64_t k) const { return seg[segment(ATOM::fold(k))].get(k); }
+
+	/**
+	 * Find Atom* of key k or return end() if no-found.
+	 */
+	ATOM* find(uint64_t k) const
+	{
+		const uint32_t s = segment(ATOM::fold(k));
+		ATOM* t = seg[s].find(k);
+		return t==seg[s].end() ? end() : t;
+	}
+
+	/**
+	 * Prefetch the home slot of key k, for a get() or find() soon.
+	 */
+	inline void prefetch(uint64_t k) const { seg[segment(ATOM::fold(k))].prefetch(k); }
+
+	/**
+	 * find() n keys, save the results in a. See BigMap::find_batch().
+	 */
+	void find_batch(const uint64_t * k, uint32_t n, ATOM ** a) const
+	{
+		for(uint32_t i=0;i<n and i<PREFETCH_DISTANCE;i++)
+			prefetch(k[i]);
+		for(uint32_t i=0;i<n;i++)
+		{
+			if(i+PREFETCH_DISTANCE<n)
+				prefetch(k[i+PREFETCH_DISTANCE]);
+			a[i] = find(k[i]);
+		}
+	}
+
+	/**
+	 * get() n keys, save the results in a. See BigMap::find_batch().
+	 */
+	void get_batch(const uint64_t * k, uint32_t n, const ATOM ** a) const
+	{
+		for(uint32_t i=0;i<n and i<PREFETCH_DISTANCE;i++)
+			prefetch(k[i]);
+		for(uint32_t i=0;i<n;i++)
+		{
+			if(i+PREFETCH_DISTANCE<n)
+				prefetch(k[i+PREFETCH_DISTANCE]);
+			a[i] = &get(k[i]);
+		}
+	}
+
+	/**
+	 * Get the Atom of key k, Create it if not found.
+	 *
+	 * Only the segment of k may grow.
+	 */
+	ATOM& operator[](uint64_t k)
+	{
+		MAP& m = seg[segment(ATOM::fold(k))];
+		const uint32_t g = m.generation();
+		ATOM& a = m[k];
+		if(m.generation()!=g)
+			gen++;
+		return a;
+	}
+
+	/**
+	 * Whether any segment would rehash on its next insertion.
+	 */
+	bool overfull() const
+	{
+		for(uint32_t s=0;s<S;s++)
+			if(seg[s].overfull())
+				return true;
+		return false;
+	}
+
+	/**
+	 * Rehash the overfull segments, one after another.
+	 */
+	bool rehash_if_overfull()
+	{
+		bool rehashed = false;
+		for(uint32_t s=0;s<S;s++)
+			if(seg[s].rehash_if_overfull())
+				rehashed = true;
+		if(rehashed)
+			gen++;
+		return rehashed;
+	}
+
+	/**
+	 * Get the Atom of key k, Create it if not found. (Thread-safe version)
+	 *
+	 * See BigMap::insert_shared().
+	 */
+	ATOM* insert_shared(uint64_t k)
+	{
+		return seg[segment(ATOM::fold(k))].insert_shared(k);
+	}
+
+	/**
+	 * Remove an Atom by pointer, return the next one.
+	 */
+	ATOM* erase(ATOM* t)
+	{
+		const uint32_t s = segment(t->k);
+		t = seg[s].erase(t);
+		gen++;
+		return t==seg[s].end() ? begin_after(s) : t;
+	}
+
+	/**
+	 * Remove an Atom by key.
+	 */
+	bool remove(uint64_t k)
+	{
+		const bool found = seg[segment(ATOM::fold(k))].remove(k);
+		if(found)
+			gen++;
+		return found;
+	}
+
+	/**
+	 * Remove all the Atom.
+	 */
+	void clear()
+	{
+		for(uint32_t s=0;s<S;s++)
+			seg[s].clear();
+		gen++;
+	}
+
+	/**
+	 * Rehash every segment to new_max_len/S slots. (at least SEGMAP_MIN_LEN)
+	 */
+	void rehash(uint64_t new_max_len)
+	{
+		new_max_len = power2ceil(new_max_len)/S;
+		if(new_max_len<SEGMAP_MIN_LEN)
+			new_max_len = SEGMAP_MIN_LEN;
+		for(uint32_t s=0;s<S;s++)
+			seg[s].rehash(new_max_len);
+		gen++;
+	}
+
+	/**
+	 * Tag of the layout of the image written by dump().
+	 */
+	static uint32_t layout() { return (S<<8) | MAP::layout(); }
+
+	/**
+	 * Bytes of the image of a map of _max_len slots in all, see dump().
+	 *
+	 * It depends on the sum only, since every segment has a power of 2
+	 * slots, not less than SEGMAP_MIN_LEN.
+	 */
+	static uint64_t image_size(uint64_t _max_len, uint64_t _dense = 0)
+	{
+		return S*sizeof(SegHead) + (_max_len+_dense)*sizeof(ATOM) + _max_len/8;
+	}
+
+	/**
+	 * Write a SegHead and the image of each segment to a (opened) file.
+	 */
+	uint64_t dump(FILE * fo)
+	{
+		uint64_t written = 0;
+		for(uint32_t s=0;s<S;s++)
+		{
+			seg[s].finish_moving();
+			SegHead h;
+			memset(&h,0,sizeof(h));
+			h.max_len = seg[s].max_size();
+			h.len = seg[s].size();
+			h.dense = seg[s].dense_size();
+			h.dense_len = seg[s].dense_limit();
+			qassert(1==fwrite(&h,sizeof(h),1,fo));
+			written += sizeof(h) + seg[s].dump(fo);
+		}
+		gen++;
+		return written;
+	}
+
+	/**
+	 * Use an image written by dump() in place, see BigMap::link().
+	 */
+	void link(void * mem, uint64_t _max_len, uint64_t _len, uint64_t _vacancy,
+			uint64_t _dense = 0, uint64_t _dense_len = 0)
+	{
+		qassert(_vacancy==0);
+		char * p = (char*)mem;
+		uint64_t sum_max_len = 0, sum_len = 0, sum_dense = 0;
+		for(uint32_t s=0;s<S;s++)
+		{
+			const SegHead* h = (const SegHead*)p;
+			qassert(h->max_len>=SEGMAP_MIN_LEN);
+			sum_max_len += h->max_len;
+			sum_len += h->len;
+			sum_dense += h->dense;
+			qassert(sum_max_len<=_max_len);
+			seg[s].link(p+sizeof(SegHead),h->max_len,h->len,0,h->dense,h->dense_len);
+			p += sizeof(SegHead) + MAP::image_size(h->max_len,h->dense);
+		}
+		qassert(sum_max_len==_max_len and sum_len==_len and sum_dense==_dense);
+		if(_dense_len!=dense_len) // the keys went to other segments
+			relocate();
+		gen++;
+	}
+
+	/**
+	 * Save the map to a (opened) file, as BigMap::save().
+	 */
+	uint64_t save(FILE * fo) const
+	{
+		fprintf(fo,"map_size: %lu\n",size());
+		for(auto t=begin();t!=end();t=next(t))
+		{
+			fprintf(fo,"0x%0lx",(uint64_t)(t->k & ~ATOM::STATE));
+			for(uint32_t i=0;i<N;i++)
+				fprintf(fo,"\t%10e",(double)t->v[i]);
+			fprintf(fo,"\n");
+		}
+		return size();
+	}
+
+	/**
+	 * Load from a (opened) file, as BigMap::load().
+	 *
+	 * Discard everything previously stored in the map if any.
+	 */
+	uint64_t load(FILE * fi)
+	{
+		uint64_t new_len;
+		qassert(1==fscanf(fi,"map_size: %lu\n",&new_len));
+		dtor();
+		rehash(power2ceil(4*new_len));
+		for(uint64_t i=0;i<new_len;i++)
+		{
+			uint64_t k;
+			qassert(1==fscanf(fi,"0x%lx",&k));
+			ATOM& t = (*this)[k];
+			for(uint32_t i=0;i<N;i++)
+			{
+				float v;
+				qassert(1==fscanf(fi,"\t%e",&v));
+				if(!std::isfinite(v))
+					error("(*0x%p)[0x%lx].v[%u] = %f, isfinite Failed.\n",
+							this,(uint64_t)ATOM::fold(k),i,v);
+				t.v[i] = v;
+			}
+			qassert('\n'==fgetc(fi));
+		}
+		return size();
+	}
+
+private:
+	SegMap(const SegMap&);
+	SegMap& operator=(const SegMap&);
+};
+
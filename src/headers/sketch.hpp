@@ -0,0 +1,134 @@
+/**
+ * @file sketch.hpp
+ * @brief Count-Min sketch, to count keys approximately.
+ * @author linus
+ * @version 1.0
+ * @date 2013-10-03
+ */
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include "headers/error.hpp"
+#include "headers/hash.hpp"
+#include "headers/bigmap2.hpp"
+
+/**
+ * A Count-Min sketch of 8-bit counters.
+ *
+ * There are depth rows of width counters, a key has a counter in each row,
+ * and its count is the least of them, which is never less than the truth.
+ * add() only increases the least ones (conservative update), to over-count
+ * less. Every 8*width add() all the counters are halved, so old counts fade
+ * and an endless stream of keys does not saturate the sketch (as TinyLFU).
+ *
+ * Several threads may add() at the same time, losing a few counts.
+ */
+class CountMin
+{
+private:
+	uint32_t width; ///< counters in a row. Should be in the power of 2
+	uint32_t depth; ///< number of rows
+	uint64_t n_add; ///< add() since the last halve()
+	uint8_t* c; ///< depth*width counters
+
+	/**
+	 * Index of the counter of a key in row i.
+	 */
+	inline uint32_t index(uint64_t h, uint32_t i) const
+	{
+		return i*width + (((uint32_t)h + i*((uint32_t)(h>>32)|1))&(width-1));
+	}
+
+public:
+	CountMin(): width(0), depth(0), n_add(0), c(NULL) {}
+
+	/**
+	 * Constructor
+	 *
+	 * @param _width counters in a row, rounded up to the power of 2
+	 * @param _depth number of rows
+	 */
+	CountMin(uint32_t _width, uint32_t _depth = 4):
+		width(power2ceil(_width)), depth(_depth), n_add(0), c(NULL)
+	{
+		qassert(depth>0);
+		c = (uint8_t*)calloc((uint64_t)width*depth,1);
+		if(!c)
+			error("calloc(%u*%u,1) returned NULL.\n",width,depth);
+	}
+
+	~CountMin()
+	{
+		if(c==NULL)
+			return;
+		free(c);
+		c = NULL;
+	}
+
+	/**
+	 * Count key k once more, return its count after that. (at most 255)
+	 */
+	uint32_t add(uint64_t k)
+	{
+		const uint64_t h = fmix(k);
+		uint32_t least = 255;
+		for(uint32_t i=0;i<depth;i++)
+			if(c[index(h,i)]<least)
+				least = c[index(h,i)];
+		if(least<255)
+		{
+			for(uint32_t i=0;i<depth;i++)
+				if(c[index(h,i)]==least)
+					c[index(h,i)] = least+1;
+			least++;
+		}
+		if(++n_add >= 8lu*width)
+			halve();
+		return least;
+	}
+
+	/**
+	 * Return the count of key k.
+	 */
+	uint32_t count(uint64_t k) const
+	{
+		const uint64_t h = fmix(k);
+		uint32_t least = 255;
+		for(uint32_t i=0;i<depth;i++)
+			if(c[index(h,i)]<least)
+				least = c[index(h,i)];
+		return least;
+	}
+
+	/**
+	 * Halve all the counters.
+	 */
+	void halve()
+	{
+		for(uint64_t i=0;i<(uint64_t)width*depth;i++)
+			c[i] >>= 1;
+		n_add = 0;
+	}
+
+	/**
+	 * Reset all the counters to 0.
+	 */
+	void clear()
+	{
+		memset(c,0,(uint64_t)width*depth);
+		n_add = 0;
+	}
+
+	/**
+	 * Bytes of memory used.
+	 */
+	uint64_t memory() const { return (uint64_t)width*depth; }
+
+private:
+	CountMin(const CountMin&);
+	CountMin& operator=(const CountMin&);
+};
+
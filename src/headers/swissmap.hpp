@@ -0,0 +1,793 @@
+/**
+ * @file swissmap.hpp
+ * @brief A HashMap probing a group of slots at a time.
+ * @author linus
+ * @version 1.0
+ * @date 2013-10-03
+ */
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "headers/error.hpp"
+#include "headers/bigmap2.hpp"
+
+#define SWISS_GROUP 16 ///< number of slots probed at a time
+#define SWISS_EMPTY 0x80 ///< control byte of a blank slot
+#define SWISS_DELETED 0xfe ///< control byte of a corpse
+#define SWISS_BUSY 0xff ///< control byte of a slot being claimed by insert_shared()
+
+/**
+ * A HashMap like BigMap, in the layout of Swiss Tables.
+ *
+ * Besides the Atom, there is a control byte for each slot: SWISS_EMPTY,
+ * SWISS_DELETED, or the low 7 bits of the hash of the living key in it.
+ * Slots are probed by aligned groups of SWISS_GROUP, the control bytes of
+ * a group are compared with the hash byte of the key by one SSE2 compare,
+ * and only the Atom whose byte matches are read. So a probe reads 16 bytes
+ * of control instead of 16 bytes of Atom, and a miss seldom reads any Atom.
+ *
+ * The groups are probed quadratically.
+ * A group which has ever been full keeps no SWISS_EMPTY until rehash,
+ * so the probing stops at the first group with a SWISS_EMPTY,
+ * and erase() leaves SWISS_EMPTY instead of a corpse if the group has one.
+ *
+ * It has the same interface as BigMap, so LR_Learner_T and Feeder can use
+ * it instead. It is rehashed when (len+vacancy) > 7/8 max_len, against 1/2
+ * of BigMap, so it takes about 17 bytes per slot but fewer slots.
+ * It has no incremental mode, set_incremental() is accepted and ignored
+ * (with a warning once), and so is set_dense().
+ * The cap works as that of BigMap, see BigMap::set_cap(), and so does
+ * the allocation policy of the array, see BigMap::set_alloc().
+ */
+template <unsigned N, typename T>
+class SwissMap
+{
+public:
+	typedef Atom<N,T> ATOM;
+
+private:
+	uint32_t max_len; ///< max number of Atom. Should be in the power of 2, >= SWISS_GROUP
+	uint32_t len; ///< number of Atom stored.
+	uint32_t mask; ///< max_len/SWISS_GROUP-1, mask of groups.
+	uint32_t vacancy; ///< number of Atom corpse. the count of SWISS_DELETED
+	uint32_t gen; ///< generation, changed when an ATOM* may become invalid
+	bool borrowed; ///< whether array and ctrl are not ours to free, see link()
+	uint32_t alloc; ///< policy of big_alloc() for new arrays, see set_alloc()
+	uint32_t array_alloc; ///< policy array was allocated by
+	uint32_t cap; ///< max number of Atom, 0 for no limit
+	uint32_t hand; ///< hand of the CLOCK, see evict()
+	uint64_t n_evicted; ///< number of Atom evicted
+	uint32_t n_rehash; ///< number of rehash by rehash_if_overfull()
+	uint8_t* ref; ///< referred bit of each slot, only if cap>0
+
+	ATOM* array;
+	uint8_t* ctrl; ///< control byte of each slot
+
+public:
+
+	SwissMap(): max_len(0),len(0),mask(0),vacancy(0),gen(0),
+		borrowed(false),alloc(ALLOC_PLAIN),array_alloc(ALLOC_PLAIN),cap(0),hand(0),n_evicted(0),n_rehash(0),ref(NULL),
+		array(NULL),ctrl(NULL) {}
+
+	SwissMap(uint32_t _max_len): max_len(0),len(0),mask(0),vacancy(0),gen(0),
+		borrowed(false),alloc(ALLOC_PLAIN),array_alloc(ALLOC_PLAIN),cap(0),hand(0),n_evicted(0),n_rehash(0),ref(NULL),
+		array(NULL),ctrl(NULL)
+	{
+		rehash(_max_len);
+	}
+
+	~SwissMap() {dtor();}
+
+	void dtor()
+	{
+		if(ref!=NULL)
+		{
+			free(ref);
+			ref = NULL;
+		}
+		if(ctrl!=NULL)
+		{
+			if(not borrowed)
+				free(ctrl);
+			ctrl = NULL;
+		}
+		if(array==NULL)
+			return;
+		if(not borrowed)
+			big_free(array,(uint64_t)max_len*sizeof(ATOM),array_alloc);
+		array = NULL;
+		borrowed = false;
+	}
+
+	/**
+	 * Print (for debug)
+	 */
+	inline void print() const
+	{
+		printf("max_len %u, len %u, vacancy %u, array %p, ctrl %p\n",
+				max_len,len,vacancy,array,ctrl);
+	}
+
+	/**
+	 * Not supported, it always rehashes at once, with a warning once if step>0.
+	 */
+	void set_incremental(uint32_t step)
+	{
+		static bool warned = false;
+		if(step>0 and not warned)
+		{
+			warning("SwissMap has no incremental mode, step %u is ignored.\n",step);
+			warned = true;
+		}
+	}
+
+	/**
+	 * Allocate the array from now on by policy, see BigMap::set_alloc().
+	 */
+	void set_alloc(uint32_t policy) { alloc = policy; }
+
+	/**
+	 * Not supported, all the keys are hashed, with a warning once if n>0.
+	 * See BigMap::set_dense().
+	 */
+	void set_dense(uint32_t n)
+	{
+		static bool warned = false;
+		if(n>0 and not warned)
+		{
+			warning("SwissMap has no dense keys, dense %u is ignored.\n",n);
+			warned = true;
+		}
+	}
+
+	/**
+	 * Always 0, see set_dense().
+	 */
+	uint32_t dense_size() const { return 0; }
+	uint32_t dense_limit() const { return 0; }
+
+	/**
+	 * Keep at most _cap Atom, evict() when more. See BigMap::set_cap().
+	 *
+	 * The array grows to at most power2ceil(2*_cap) slots,
+	 * of sizeof(Atom) bytes, a control byte and a referred byte each.
+	 */
+	void set_cap(uint32_t _cap)
+	{
+		cap = _cap;
+		alloc_ref();
+		if(cap>0 and len>cap)
+			evict(len-cap);
+	}
+
+	/**
+	 * Whether it keeps as many Atom as its cap.
+	 */
+	bool full() const { return cap>0 and len>=cap; }
+
+	/**
+	 * Number of Atom evicted so far.
+	 */
+	uint64_t evictions() const { return n_evicted; }
+
+	/**
+	 * Number of rehash done because it was overfull.
+	 */
+	uint32_t rehashes() const { return n_rehash; }
+
+	/**
+	 * Evict n living Atom, by CLOCK with weight. See BigMap::evict().
+	 */
+	void evict(uint32_t n = 1)
+	{
+		for(;n>0 and len>0;n--)
+		{
+			ATOM* victim = NULL;
+			double least = 0;
+			uint32_t n_candidate = 0;
+			// every bit is cleared in the first round
+			for(uint64_t i=0;i<2lu*max_len and n_candidate<EVICT_SAMPLE;i++)
+			{
+				const uint32_t index = hand;
+				hand = (hand+1)&(max_len-1);
+				if(ctrl[index]>=0x80)
+					continue;
+				if(ref!=NULL and ref[index]!=0)
+				{
+					ref[index] = 0;
+					continue;
+				}
+				const double w = fabs((double)array[index].v[0]);
+				if(victim==NULL or w<least)
+				{
+					victim = array+index;
+					least = w;
+				}
+				n_candidate++;
+			}
+			erase(victim);
+			n_evicted++;
+		}
+	}
+
+	/**
+	 * Always false, see set_incremental().
+	 */
+	bool moving() const { return false; }
+
+	/**
+	 * Nothing to do, see set_incremental().
+	 */
+	void finish_moving() {}
+
+private:
+	/**
+	 * (Re)allocate the referred bits for array, if cap>0.
+	 */
+	void alloc_ref()
+	{
+		if(ref!=NULL)
+			free(ref);
+		ref = NULL;
+		hand = 0;
+		if(cap==0 or array==NULL)
+			return;
+		ref = (uint8_t*)calloc(max_len,1);
+		if(!ref)
+			error("calloc(%u,1) returned NULL.\n",max_len);
+	}
+
+	/**
+	 * Hash of a key. (ignore the top 2 bits as BigMap does)
+	 *
+	 * The low 7 bits go to the control byte, the rest choose the group.
+	 */
+	static inline uint64_t hash(uint64_t k)
+	{
+		k = (k & ~(3lu<<62)) * 0x9e3779b97f4a7c15lu;
+		return k ^ (k>>32);
+	}
+
+	/**
+	 * Bits of the slots in group g, whose control bytes are c.
+	 */
+	inline uint32_t match(uint32_t g, uint8_t c) const
+	{
+#ifdef __SSE2__
+		const __m128i x = _mm_loadu_si128((const __m128i*)(ctrl+g*SWISS_GROUP));
+		return _mm_movemask_epi8(_mm_cmpeq_epi8(x,_mm_set1_epi8((char)c)));
+#else
+		uint32_t b = 0;
+		for(uint32_t i=0;i<SWISS_GROUP;i++)
+			b |= (uint32_t)(ctrl[g*SWISS_GROUP+i]==c) << i;
+		return b;
+#endif
+	}
+
+	/**
+	 * Bits of the slots in group g, which are not living.
+	 */
+	inline uint32_t match_free(uint32_t g) const
+	{
+#ifdef __SSE2__
+		const __m128i x = _mm_loadu_si128((const __m128i*)(ctrl+g*SWISS_GROUP));
+		return _mm_movemask_epi8(x);
+#else
+		uint32_t b = 0;
+		for(uint32_t i=0;i<SWISS_GROUP;i++)
+			b |= (uint32_t)(ctrl[g*SWISS_GROUP+i]>>7) << i;
+		return b;
+#endif
+	}
+
+	/**
+	 * Bits of the slots in group g, which are living.
+	 */
+	inline uint32_t match_full(uint32_t g) const
+	{
+		return ~match_free(g) & ((1u<<SWISS_GROUP)-1);
+	}
+
+	bool _find(uint64_t k, uint32_t & index_found, uint32_t & index_new) const
+	// Find key k, return whether found
+	// when found, save index in index_found, and ~0u in index_new.
+	// when no-found, save ~0u in index_found,
+	//                and where to insert k in index_new.
+	{
+		index_found = index_new = ~0u;
+		const uint64_t h = hash(k);
+		const uint8_t c = h & 0x7f;
+		uint32_t g = (h>>7) & mask; // which group to look for
+		for(uint32_t count_miss=0;;)
+		{
+			for(uint32_t b=match(g,c);b!=0;b&=b-1)
+			{
+				const uint32_t index = g*SWISS_GROUP + __builtin_ctz(b);
+				if(((array[index].k^k)&~(3lu<<62))==0)
+				{
+					index_found = index;
+					index_new = ~0u;
+					return true;
+				}
+			}
+			if(index_new==~0u)
+			{
+				const uint32_t b = match_free(g);
+				if(b!=0)
+					index_new = g*SWISS_GROUP + __builtin_ctz(b);
+			}
+			if(match(g,SWISS_EMPTY)!=0)
+				return false;
+			count_miss ++;
+			if(count_miss>mask)
+				return false;
+			g = (g+count_miss)&mask;
+		}
+	}
+
+	bool _find(uint64_t k, uint32_t & index_found) const
+	// Find key k, return whether found
+	// when found, save index in index_found.
+	// when no-found, save ~0u in index_found.
+	{
+		index_found = ~0u;
+		const uint64_t h = hash(k);
+		const uint8_t c = h & 0x7f;
+		uint32_t g = (h>>7) & mask; // which group to look for
+		for(uint32_t count_miss=0;;)
+		{
+			for(uint32_t b=match(g,c);b!=0;b&=b-1)
+			{
+				const uint32_t index = g*SWISS_GROUP + __builtin_ctz(b);
+				if(((array[index].k^k)&~(3lu<<62))==0)
+				{
+					index_found = index;
+					return true;
+				}
+			}
+			if(match(g,SWISS_EMPTY)!=0)
+				return false;
+			count_miss ++;
+			if(count_miss>mask)
+				return false;
+			g = (g+count_miss)&mask;
+		}
+	}
+
+public:
+	/**
+	 * Return how many Atom are stored.
+	 */
+	uint32_t size() const { return len; }
+
+	/**
+	 * Return max number of Atom could be stored.
+	 */
+	uint32_t max_size() const { return max_len; }
+
+	/**
+	 * Return number of Atom corpse.
+	 */
+	uint32_t vacancies() const { return vacancy; }
+
+	/**
+	 * Return the generation of the map, see BigMap::generation().
+	 */
+	uint32_t generation() const { return gen; }
+
+	/**
+	 * Return next Atom after t.
+	 *
+	 * Note that you should not traverse the map while deleting Atom from it.
+	 * (except by erase(), which returns the next one.)
+	 */
+	ATOM* next(ATOM* t) const
+	{
+		const uint32_t index = t+1-array;
+		if(index>=max_len)
+			return array+max_len;
+		uint32_t g = index/SWISS_GROUP;
+		uint32_t b = match_full(g) & (~0u << (index%SWISS_GROUP));
+		while(b==0)
+		{
+			if(++g>mask)
+				return array+max_len;
+			b = match_full(g);
+		}
+		return array + g*SWISS_GROUP + __builtin_ctz(b);
+	}
+
+	/**
+	 * Return the pointer to the first Atom.
+	 */
+	ATOM* begin() const { return next(array-1); }
+
+	/**
+	 * Return the pointer after the last Atom.
+	 */
+	ATOM* end() const { return array+max_len; }
+
+	/**
+	 * Get the Atom of key k, return an Atom with all zero if not found.
+	 */
+	const ATOM& get(uint64_t k) const
+	{
+		static const ATOM null_atom(true);
+		uint32_t index_found;
+		if(_find(k,index_found))
+			return array[index_found];
+		else
+			return null_atom;
+	}
+
+	/**
+	 * Find the Atom of key k, return end() if not found.
+	 */
+	ATOM* find(uint64_t k) const
+	{
+		uint32_t index_found;
+		if(!_find(k,index_found))
+			return array+max_len;
+		if(ref!=NULL)
+			ref[index_found] = 1;
+		return array+index_found;
+	}
+
+	/**
+	 * Prefetch the control bytes of the first group of key k.
+	 */
+	inline void prefetch(uint64_t k) const
+	{
+		__builtin_prefetch(ctrl+((hash(k)>>7)&mask)*SWISS_GROUP);
+	}
+
+	/**
+	 * find() n keys, save the results in a. See BigMap::find_batch().
+	 */
+	void find_batch(const uint64_t * k, uint32_t n, ATOM ** a) const
+	{
+		for(uint32_t i=0;i<n and i<PREFETCH_DISTANCE;i++)
+			prefetch(k[i]);
+		for(uint32_t i=0;i<n;i++)
+		{
+			if(i+PREFETCH_DISTANCE<n)
+				prefetch(k[i+PREFETCH_DISTANCE]);
+			a[i] = find(k[i]);
+		}
+	}
+
+	/**
+	 * get() n keys, save the results in a. See find_batch().
+	 */
+	void get_batch(const uint64_t * k, uint32_t n, const ATOM ** a) const
+	{
+		for(uint32_t i=0;i<n and i<PREFETCH_DISTANCE;i++)
+			prefetch(k[i]);
+		for(uint32_t i=0;i<n;i++)
+		{
+			if(i+PREFETCH_DISTANCE<n)
+				prefetch(k[i+PREFETCH_DISTANCE]);
+			a[i] = &get(k[i]);
+		}
+	}
+
+	/**
+	 * Get the Atom of key k, Create it if not found.
+	 */
+	ATOM& operator[](uint64_t k)
+	{
+		uint32_t index_found, index_new;
+		if(_find(k,index_found,index_new))
+		{
+			if(ref!=NULL)
+				ref[index_found] = 1;
+			return array[index_found];
+		}
+		if(full())
+		{
+			evict();
+			return (*this)[k];
+		}
+		if(rehash_if_overfull())
+			return (*this)[k];
+		qassert(index_new!=~0u);
+		if(ctrl[index_new]==SWISS_DELETED)
+			vacancy--;
+		ctrl[index_new] = hash(k) & 0x7f;
+		array[index_new].k = k | (3lu<<62);
+		len++;
+		return array[index_new];
+	}
+
+	/**
+	 * Whether the next insertion by operator[] would rehash.
+	 */
+	bool overfull() const
+	{
+		return 8*(uint64_t)(len+vacancy) > 7*(uint64_t)max_len;
+	}
+
+	/**
+	 * Rehash if overfull, return whether rehashed.
+	 *
+	 * Expand the map if it is really full of living Atom,
+	 * else just clean the corpses.
+	 */
+	bool rehash_if_overfull()
+	{
+		if(not overfull())
+			return false;
+		n_rehash++;
+		uint32_t new_max_len = (2*(uint64_t)len > max_len) ?
+			((max_len<1<<24)?4:2)*max_len : // expand
+			max_len;
+		if(cap>0 and new_max_len>power2ceil(2*cap)) // enough for cap
+			new_max_len = power2ceil(2*cap);
+		rehash(new_max_len);
+		return true;
+	}
+
+	/**
+	 * Get the Atom of key k, Create it if not found. (Thread-safe version)
+	 *
+	 * See BigMap::insert_shared(). A slot is claimed by compare-and-swap of
+	 * its control byte from SWISS_EMPTY to SWISS_BUSY, then the key is
+	 * written and the byte is set. The whole group is checked for k before
+	 * claiming its first SWISS_EMPTY, so two threads would never put k in
+	 * two different slots, if nobody erase() or remove() at the same time.
+	 * Return NULL if the map is full, or (len+vacancy) reaches 15/16 of
+	 * max_len, past overfull(), so the probing stays short until rehashed.
+	 */
+	ATOM* insert_shared(uint64_t k)
+	{
+		if(full()) // call evict() first
+			return NULL;
+		const uint64_t key = k | (3lu<<62);
+		const uint64_t h = hash(k);
+		const uint8_t c = h & 0x7f;
+		uint32_t g = (h>>7) & mask;
+		for(uint32_t count_miss=0;;)
+		{
+			uint32_t index_new = ~0u;
+			for(uint32_t i=g*SWISS_GROUP;i<(g+1)*SWISS_GROUP;i++)
+			{
+				uint8_t b;
+				while(SWISS_BUSY==(b=__atomic_load_n(ctrl+i,__ATOMIC_ACQUIRE)))
+					; // someone is writing the key
+				if(b==c and array[i].k==key)
+				{
+					if(ref!=NULL)
+						ref[i] = 1;
+					return array+i;
+				}
+				if(b==SWISS_EMPTY and index_new==~0u)
+					index_new = i;
+			}
+			if(index_new!=~0u)
+			{
+				if(16*(uint64_t)(len+vacancy) >= 15*(uint64_t)max_len)
+					return NULL;
+				uint8_t e = SWISS_EMPTY;
+				if(__atomic_compare_exchange_n(ctrl+index_new,&e,(uint8_t)SWISS_BUSY,
+							false,__ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE))
+				{
+					array[index_new].k = key;
+					__atomic_store_n(ctrl+index_new,c,__ATOMIC_RELEASE);
+					__sync_fetch_and_add(&len,1);
+					return array+index_new;
+				}
+				continue; // someone else took it, look again
+			}
+			count_miss ++;
+			if(count_miss>mask)
+				return NULL;
+			g = (g+count_miss)&mask;
+		}
+	}
+
+	/**
+	 * Erase the Atom pointed by t, return next(t).
+	 */
+	ATOM* erase(ATOM* t)
+	{
+		const uint32_t index = t-array;
+		if(not(array<=t and t<array+max_len and ctrl[index]<0x80))
+			error("Invalid ATOM* to erase. (%p<=%p<=%p,0x%02x)\n",
+					array,t,array+max_len,(array<=t and t<array+max_len)?ctrl[index]:0);
+		if(match(index/SWISS_GROUP,SWISS_EMPTY)!=0)
+			ctrl[index] = SWISS_EMPTY;
+		else
+		{
+			ctrl[index] = SWISS_DELETED;
+			vacancy++;
+		}
+		t->k = 0;
+		memset(t->v,0,N*sizeof(T));
+		if(ref!=NULL)
+			ref[index] = 0;
+		len--;
+		gen++;
+		return next(t);
+	}
+
+	/**
+	 * Remove key k, return if successful.
+	 */
+	bool remove(uint64_t k)
+	{
+		uint32_t index_found;
+		bool found = _find(k,index_found);
+		if(found)
+			erase(array+index_found);
+		return found;
+	}
+
+	/**
+	 * Remove all the Atom.
+	 */
+	void clear()
+	{
+		if(ref!=NULL)
+			memset(ref,0,max_len);
+		if(len!=0 or vacancy!=0)
+		{
+			memset(ctrl,SWISS_EMPTY,max_len);
+			memset(array,0,max_len*sizeof(ATOM));
+		}
+		len = 0;
+		vacancy = 0;
+		gen++;
+	}
+
+	/**
+	 * Rehash the map.
+	 *
+	 * If array is NULL, this will make a new valid map.
+	 * Else, it will transfer everything to a new map.
+	 * new_max_len is rounded up to the power of 2, at least SWISS_GROUP.
+	 */
+	void rehash(uint32_t new_max_len)
+	{
+		qassert(new_max_len!=0);
+		new_max_len = power2ceil(new_max_len);
+		if(new_max_len<SWISS_GROUP)
+			new_max_len = SWISS_GROUP;
+		if(array==NULL)
+		{
+			max_len = new_max_len;
+			len = 0;
+			vacancy = 0;
+			mask = max_len/SWISS_GROUP - 1;
+			borrowed = false;
+			array = (ATOM*)big_alloc((uint64_t)max_len*sizeof(ATOM),alloc);
+			if(!array)
+				error("big_alloc(%u*%lu) returned NULL.\n",max_len,sizeof(ATOM));
+			array_alloc = alloc;
+			ctrl = (uint8_t*)malloc(max_len);
+			if(!ctrl)
+				error("malloc(%u) returned NULL.\n",max_len);
+			memset(ctrl,SWISS_EMPTY,max_len);
+			alloc_ref();
+			return;
+		}
+		// make new map
+		SwissMap newm;
+		newm.alloc = alloc;
+		newm.rehash(new_max_len);
+		newm.gen = gen+1;
+		newm.cap = cap;
+		newm.n_evicted = n_evicted;
+		newm.n_rehash = n_rehash;
+		newm.alloc_ref();
+		if(len!=0)
+			for(ATOM* t=begin();t!=end();t=next(t))
+				memcpy(newm[t->k].v,t->v,N*sizeof(T)); // only copy v[N]
+		// swap
+		char * buffer = (char*)malloc(sizeof(*this));
+		qassert(buffer!=NULL);
+		memcpy(buffer,&newm,sizeof(*this));
+		memcpy(&newm,this,sizeof(*this));
+		memcpy(this,buffer,sizeof(*this));
+		free(buffer);
+	}
+
+	/**
+	 * Tag of the layout of the image written by dump().
+	 */
+	static uint32_t layout() { return 2; }
+
+	/**
+	 * Bytes of the image of a map of _max_len, see dump().
+	 */
+	static uint64_t image_size(uint32_t _max_len, uint32_t _dense = 0)
+	{
+		return (uint64_t)_max_len*(sizeof(ATOM)+1);
+	}
+
+	/**
+	 * Write the Atom then the control bytes to a (opened) file,
+	 * return bytes written. See BigMap::dump().
+	 */
+	uint64_t dump(FILE * fo)
+	{
+		qassert(max_len==fwrite(array,sizeof(ATOM),max_len,fo));
+		qassert(max_len==fwrite(ctrl,1,max_len,fo));
+		return image_size(max_len);
+	}
+
+	/**
+	 * Use an image written by dump() in place. See BigMap::link().
+	 */
+	void link(void * mem, uint32_t _max_len, uint32_t _len, uint32_t _vacancy,
+			uint32_t _dense = 0, uint32_t _dense_len = 0)
+	{
+		qassert(_max_len>=SWISS_GROUP and (_max_len&(_max_len-1))==0);
+		qassert(_dense==0);
+		qassert(_len+_vacancy<=_max_len);
+		dtor();
+		array = (ATOM*)mem;
+		ctrl = (uint8_t*)(array+_max_len);
+		borrowed = true;
+		max_len = _max_len;
+		mask = max_len/SWISS_GROUP - 1;
+		len = _len;
+		vacancy = _vacancy;
+		gen++;
+		alloc_ref();
+	}
+
+	/**
+	 * Save the map to a (opened) file, in the format of BigMap::save().
+	 */
+	uint32_t save(FILE * fo) const
+	{
+		fprintf(fo,"map_size: %u\n",len);
+		for(auto t=begin();t!=end();t=next(t))
+		{
+			fprintf(fo,"0x%0lx",t->k & ~(3lu<<62));
+			for(uint32_t i=0;i<N;i++)
+				fprintf(fo,"\t%10e",(double)t->v[i]);
+			fprintf(fo,"\n");
+		}
+		return len;
+	}
+
+	/**
+	 * Load from a (opened) file.
+	 *
+	 * Discard everything previously stored in the map if any.
+	 */
+	uint32_t load(FILE * fi)
+	{
+		uint32_t new_len;
+		qassert(1==fscanf(fi,"map_size: %u\n",&new_len));
+		dtor();
+		rehash(power2ceil(2*new_len));
+		for(uint32_t i=0;i<new_len;i++)
+		{
+			uint64_t k;
+			qassert(1==fscanf(fi,"0x%lx",&k));
+			ATOM& t = (*this)[k];
+			for(uint32_t i=0;i<N;i++)
+			{
+				float v;
+				qassert(1==fscanf(fi,"\t%e",&v));
+				if(!std::isfinite(v))
+					error("(*0x%p)[0x%lx].v[%u] = %f, isfinite Failed.\n",
+							this,k&~(3lu<<62),i,v);
+				t.v[i] = v;
+			}
+			qassert('\n'==fgetc(fi));
+		}
+		return len;
+	}
+
+};
+
@@ -0,0 +1,681 @@
+/**
+ * @file tiermap.hpp
+ * @brief A BigMap with a small hot tier in front, for the frequent keys.
+ * @author linus
+ * @version 1.0
+ * @date 2013-10-03
+ */
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include "headers/error.hpp"
+#include "headers/hash.hpp"
+#include "headers/bigmap2.hpp"
+#include "headers/sketch.hpp"
+
+#ifndef TIERED_HOT_LEN
+#define TIERED_HOT_LEN 4096 ///< default hot_size() of a TieredMap
+#endif
+#define TIERED_FILTER 4 ///< bytes of the filter for each hot slot, see maybe_hot()
+#ifndef TIERED_SAMPLE
+#define TIERED_SAMPLE 16 ///< one in so many hits is counted, see TieredMap
+#endif
+
+/**
+ * A BigMap (the cold tier) with a small BigMap (the hot tier) in front.
+ *
+ * The keys are skewed: a few thousand keys of a space take most of
+ * the lookups, and the rest are spread over millions of slots. In a
+ * flat map every hot key has a cache line of its own among cold ones,
+ * so the hot keys alone need more lines than the cache holds. Here
+ * the hot tier keeps at most hot_size() Atom in a table of twice the
+ * slots, 128 KB for 4096 Atom of 16 bytes, which stays in the cache,
+ * and each key is in one tier only.
+ *
+ * It pays only if the hot lines of a flat map do not stay in the cache.
+ * With a last-level cache large enough for them, a flat BigMap is faster,
+ * since a lookup here runs more instructions (the filter, the counts, and
+ * two probes for a cold key), so fewer lookups overlap their cache misses.
+ *
+ * find() and operator[] look in the hot tier first. One in TIERED_SAMPLE
+ * of the keys they find is counted in a CountMin, which costs little, and
+ * such a key found in the cold tier is promoted, if the hot tier has room,
+ * or if it is counted more than the victim of the CLOCK of the hot tier
+ * (see BigMap::victim()), which is demoted to the cold tier then (as
+ * TinyLFU admits). The counts are halved now and then, so the hot set
+ * follows the traffic. New keys start cold. Every move costs an erase()
+ * and an insertion, and leaves the moved keys farther from their home
+ * slots, so a key is promoted only if it beats the victim.
+ * A missed probe of the hot tier is not free, a few branches taken
+ * at random, so a filter of TIERED_FILTER bytes for each hot slot counts
+ * the hot keys hashed to each byte, and most cold keys skip the hot tier.
+ * get(), the const find() and insert_shared() only look, so the threads
+ * of LR_Learner_T::digest_shared() may use them at the same time.
+ * Keys below the n of set_dense() stay in the dense array of the cold
+ * tier, which is as fast.
+ *
+ * The hits of each tier are counted, see hot_hits() and hit_rate().
+ *
+ * It has the same interface as BigMap, so LR_Learner_T can use it
+ * instead. The cap, the growing and the eviction are of the cold tier,
+ * the hot one holds at most hot_size() Atom more. finish_moving() moves
+ * the hot Atom back to the cold tier, so dump() writes the image of
+ * a BigMap, and a model saved by a BigMap links here and back.
+ * A moved Atom changes generation(), so ATOM* found before may be
+ * invalid, as after BigMap::erase().
+ */
+template <unsigned N, typename T, typename I = uint32_t, typename K = uint64_t>
+class TieredMap
+{
+public:
+	typedef BigMap<N,T,I,K> MAP;
+	typedef typename MAP::ATOM ATOM;
+
+private:
+	MAP hot; ///< hot tier, a capped BigMap of power2ceil(2*hot_cap) slots
+	MAP cold; ///< cold tier
+	CountMin* sketch; ///< counts of the sampled hits
+	uint8_t* filter; ///< number of hot keys of each slot(), saturated at 255
+	uint32_t filter_shift; ///< 64 - log2 of the bytes of filter
+	uint32_t hot_cap; ///< max number of Atom in hot, 0 before the first rehash()
+	uint32_t gen; ///< generation of its own, see generation()
+	uint32_t n_skip; ///< hits since the last sampled one
+	uint64_t n_hot; ///< hits in hot
+	uint64_t n_cold; ///< hits in cold
+	uint64_t n_miss; ///< keys found nowhere
+	uint64_t n_promoted; ///< Atom moved from cold to hot
+	uint64_t n_demoted; ///< Atom moved from hot to cold
+
+	/**
+	 * Whether the state bits of Atom t say living.
+	 */
+	static inline bool living(const ATOM& t) { return (t.k & ATOM::STATE)==ATOM::STATE; }
+
+	/**
+	 * Slot of a folded key k in filter.
+	 */
+	inline uint64_t slot(K k) const
+	{
+		return ((uint64_t)k*0x9e3779b97f4a7c15lu)>>filter_shift;
+	}
+
+	/**
+	 * Whether key k may be in the hot tier, false if surely not.
+	 */
+	inline bool maybe_hot(uint64_t key) const
+	{
+		return filter!=NULL and filter[slot(ATOM::fold(key))]!=0;
+	}
+
+	/**
+	 * Count a folded key k in or out of the filter.
+	 */
+	inline void mark(K k)
+	{
+		if(filter[slot(k)]<255)
+			filter[slot(k)]++;
+	}
+
+	inline void unmark(K k)
+	{
+		if(filter[slot(k)]<255) // saturated, kept as maybe forever
+			filter[slot(k)]--;
+	}
+
+	/**
+	 * Set up the hot tier with the default size, if not yet.
+	 */
+	void init_hot()
+	{
+		if(hot_cap==0)
+			set_hot(TIERED_HOT_LEN);
+	}
+
+	/**
+	 * Move Atom t of the hot tier to the cold one.
+	 */
+	void demote(ATOM* t)
+	{
+		T v[N];
+		memcpy(v,t->v,N*sizeof(T));
+		const K k = t->k & ~ATOM::STATE;
+		unmark(k);
+		hot.erase(t);
+		memcpy(cold[k].v,v,N*sizeof(T));
+		n_demoted++;
+	}
+
+	/**
+	 * Whether this hit is sampled, one in TIERED_SAMPLE.
+	 */
+	inline bool sampled()
+	{
+		if(++n_skip<TIERED_SAMPLE)
+			return false;
+		n_skip = 0;
+		return true;
+	}
+
+	/**
+	 * Move Atom t of the cold tier, counted c, to the hot one if it beats
+	 * the victim, return where it is then.
+	 */
+	ATOM* promote(ATOM* t, uint32_t c)
+	{
+		ATOM* victim = NULL;
+		if(hot.full())
+		{
+			victim = hot.victim();
+			if(victim==NULL or sketch->count(victim->k & ~ATOM::STATE)>=c)
+				return t;
+		}
+		T v[N];
+		memcpy(v,t->v,N*sizeof(T));
+		const K k = t->k & ~ATOM::STATE;
+		cold.erase(t); // before demote(), which may grow cold
+		if(victim!=NULL)
+			demote(victim);
+		ATOM& a = hot[k];
+		memcpy(a.v,v,N*sizeof(T));
+		mark(k);
+		n_promoted++;
+		return &a;
+	}
+
+public:
+	TieredMap(): sketch(NULL), filter(NULL), filter_shift(64), hot_cap(0),
+		gen(0), n_skip(0), n_hot(0), n_cold(0), n_miss(0), n_promoted(0),
+		n_demoted(0) {}
+
+	TieredMap(uint64_t _max_len): sketch(NULL), filter(NULL), filter_shift(64),
+		hot_cap(0), gen(0), n_skip(0), n_hot(0), n_cold(0), n_miss(0),
+		n_promoted(0), n_demoted(0) { rehash(_max_len); }
+
+	~TieredMap() {dtor();}
+
+	void dtor()
+	{
+		hot.dtor();
+		cold.dtor();
+		delete sketch;
+		sketch = NULL;
+		free(filter);
+		filter = NULL;
+		hot_cap = 0;
+	}
+
+	/**
+	 * Print (for debug)
+	 */
+	inline void print() const
+	{
+		printf("hot: ");
+		hot.print();
+		printf("cold: ");
+		cold.print();
+	}
+
+	/**
+	 * Keep at most n Atom in the hot tier. (TIERED_HOT_LEN by default)
+	 *
+	 * The Atom in the hot tier are moved to the cold one, and the counts
+	 * start over.
+	 */
+	void set_hot(uint32_t n)
+	{
+		qassert(n>0);
+		flush();
+		hot.dtor();
+		hot_cap = n;
+		hot.set_cap(n);
+		hot.rehash(power2ceil(2lu*n));
+		const uint64_t bytes = power2ceil((uint64_t)TIERED_FILTER*hot.max_size());
+		free(filter);
+		filter = (uint8_t*)calloc(bytes,1);
+		if(!filter)
+			error("calloc(%lu,1) returned NULL.\n",bytes);
+		filter_shift = 64-__builtin_ctzl(bytes);
+		delete sketch;
+		sketch = new CountMin(2*n);
+		gen++;
+	}
+
+	/**
+	 * The n of set_hot(), 0 if not set up yet.
+	 */
+	uint32_t hot_size() const { return hot_cap; }
+
+	/**
+	 * Move all the Atom of the hot tier to the cold one.
+	 */
+	void flush()
+	{
+		if(hot_cap==0)
+			return;
+		for(auto t=hot.begin();t!=hot.end();t=hot.begin())
+			demote(t);
+	}
+
+	/**
+	 * Number of lookups by find() and operator[] hit in the hot tier.
+	 */
+	uint64_t hot_hits() const { return n_hot; }
+
+	/**
+	 * Number of lookups by find() and operator[] hit in the cold tier.
+	 */
+	uint64_t cold_hits() const { return n_cold; }
+
+	/**
+	 * Number of lookups by find() and operator[] of absent keys.
+	 */
+	uint64_t misses() const { return n_miss; }
+
+	/**
+	 * Number of Atom promoted to the hot tier so far.
+	 */
+	uint64_t promotions() const { return n_promoted; }
+
+	/**
+	 * Number of Atom demoted to the cold tier so far.
+	 */
+	uint64_t demotions() const { return n_demoted; }
+
+	/**
+	 * Fraction of the hits in the hot tier, 0 if none yet.
+	 */
+	double hit_rate() const
+	{
+		return n_hot+n_cold>0 ? (double)n_hot/(n_hot+n_cold) : 0;
+	}
+
+	/**
+	 * See BigMap::set_incremental(), of the cold tier.
+	 */
+	void set_incremental(uint32_t step) { cold.set_incremental(step); }
+
+	/**
+	 * See BigMap::set_alloc(), of the cold tier. (The hot one is small.)
+	 */
+	void set_alloc(uint32_t policy) { cold.set_alloc(policy); }
+
+	/**
+	 * Keep the keys below n in the dense array of the cold tier,
+	 * see BigMap::set_dense().
+	 */
+	void set_dense(uint64_t n)
+	{
+		if(n==cold.dense_limit())
+			return;
+		flush();
+		cold.set_dense(n);
+		gen++;
+	}
+
+	/**
+	 * Number of Atom of the dense array, 0 if not allocated.
+	 */
+	uint64_t dense_size() const { return cold.dense_size(); }
+
+	/**
+	 * The n of set_dense().
+	 */
+	uint64_t dense_limit() const { return cold.dense_limit(); }
+
+	/**
+	 * Keep at most _cap Atom in the cold tier, see BigMap::set_cap().
+	 */
+	void set_cap(I _cap) { cold.set_cap(_cap); }
+
+	/**
+	 * Whether the cold tier keeps as many Atom as its cap.
+	 */
+	bool full() const { return cold.full(); }
+
+	/**
+	 * Number of Atom evicted so far.
+	 */
+	uint64_t evictions() const { return cold.evictions(); }
+
+	/**
+	 * Number of rehash done because the cold tier was overfull.
+	 */
+	uint32_t rehashes() const { return cold.rehashes(); }
+
+	/**
+	 * Evict n Atom of the cold tier, see BigMap::evict().
+	 */
+	void evict(I n = 1) { cold.evict(n); }
+
+	/**
+	 * Whether the cold tier is moving, see BigMap::moving().
+	 */
+	bool moving() const { return cold.moving(); }
+
+	/**
+	 * Move everything left in the old array of the cold tier,
+	 * and the Atom of the hot tier to the cold one.
+	 */
+	void finish_moving()
+	{
+		cold.finish_moving();
+		flush();
+	}
+
+	/**
+	 * Return how many Atom are stored.
+	 */
+	uint64_t size() const { return hot.size()+cold.size(); }
+
+	/**
+	 * Return max number of Atom could be stored in the cold tier.
+	 */
+	uint64_t max_size() const { return cold.max_size(); }
+
+	/**
+	 * Return number of dead Atom 's body. (Always 0, see BigMap.)
+	 */
+	uint64_t vacancies() const { return 0; }
+
+	/**
+	 * Return the generation of the map, see BigMap::generation().
+	 *
+	 * It changes when either tier changes its own.
+	 */
+	uint32_t generation() const { return gen+hot.generation()+cold.generation(); }
+
+	/**
+	 * Return next Atom after t, see BigMap::next().
+	 */
+	ATOM* next(ATOM* t) const
+	{
+		if(not hot.owns(t))
+			return cold.next(t);
+		t = hot.next(t);
+		return t!=hot.end() ? t : cold.begin();
+	}
+
+	/**
+	 * Return the pointer to the first Atom, the hot ones go first.
+	 */
+	ATOM* begin() const
+	{
+		ATOM* t = hot.begin();
+		return t!=hot.end() ? t : cold.begin();
+	}
+
+	/**
+	 * Return the pointer to the last Atom.
+	 */
+	ATOM* end() const { return cold.end(); }
+
+	/**
+	 * Return the reference of Atom of key k or of a blank Atom() if not found.
+	 *
+	 * It neither counts nor promotes.
+	 */
+	const ATOM& get(uint64_t k) const
+	{
+		if(maybe_hot(k))
+		{
+			const ATOM& a = hot.get(k);
+			if(living(a))
+				return a;
+		}
+		return cold.get(k);
+	}
+
+	/**
+	 * Find Atom* of key k or return end() if no-found.
+	 *
+	 * It neither counts nor promotes, as get().
+	 */
+	ATOM* find(uint64_t k) const
+	{
+		if(maybe_hot(k))
+		{
+			ATOM* t = hot.find(k);
+			if(t!=hot.end())
+				return t;
+		}
+		return cold.find(k);
+	}
+
+	/**
+	 * Find Atom* of key k or return end() if no-found.
+	 *
+	 * It may count k and promote it, see TieredMap.
+	 */
+	ATOM* find(uint64_t key)
+	{
+		if(hot_cap==0)
+			return cold.find(key);
+		const K k = ATOM::fold(key);
+		if(k<cold.dense_limit())
+			return cold.find(k);
+		if(maybe_hot(k))
+		{
+			ATOM* t = hot.find(k);
+			if(t!=hot.end())
+			{
+				n_hot++;
+				if(sampled())
+					sketch->add(k);
+				return t;
+			}
+		}
+		ATOM* t = cold.find(k);
+		if(t==cold.end())
+		{
+			n_miss++;
+			return t;
+		}
+		n_cold++;
+		if(not sampled())
+			return t;
+		return promote(t,sketch->add(k));
+	}
+
+	/**
+	 * Prefetch the home slots of key k in both tiers, for a get() or find() soon.
+	 */
+	inline void prefetch(uint64_t k) const
+	{
+		if(maybe_hot(k))
+			hot.prefetch(k);
+		cold.prefetch(k);
+	}
+
+	/**
+	 * find() n keys, save the results in a. See BigMap::find_batch().
+	 */
+	void find_batch(const uint64_t * k, uint32_t n, ATOM ** a)
+	{
+		for(uint32_t i=0;i<n and i<PREFETCH_DISTANCE;i++)
+			prefetch(k[i]);
+		for(uint32_t i=0;i<n;i++)
+		{
+			if(i+PREFETCH_DISTANCE<n)
+				prefetch(k[i+PREFETCH_DISTANCE]);
+			a[i] = find(k[i]);
+		}
+	}
+
+	/**
+	 * get() n keys, save the results in a. See BigMap::find_batch().
+	 */
+	void get_batch(const uint64_t * k, uint32_t n, const ATOM ** a) const
+	{
+		for(uint32_t i=0;i<n and i<PREFETCH_DISTANCE;i++)
+			prefetch(k[i]);
+		for(uint32_t i=0;i<n;i++)
+		{
+			if(i+PREFETCH_DISTANCE<n)
+				prefetch(k[i+PREFETCH_DISTANCE]);
+			a[i] = &get(k[i]);
+		}
+	}
+
+	/**
+	 * Get the Atom of key k, Create it in the cold tier if not found.
+	 */
+	ATOM& operator[](uint64_t k)
+	{
+		ATOM* t = find(k);
+		return t!=end() ? *t : cold[k];
+	}
+
+	/**
+	 * Whether the next insertion by operator[] would rehash.
+	 */
+	bool overfull() const { return cold.overfull(); }
+
+	/**
+	 * Rehash the cold tier if overfull, return whether rehashed.
+	 */
+	bool rehash_if_overfull() { return cold.rehash_if_overfull(); }
+
+	/**
+	 * Get the Atom of key k, Create it if not found. (Thread-safe version)
+	 *
+	 * A new key goes to the cold tier, see BigMap::insert_shared().
+	 */
+	ATOM* insert_shared(uint64_t k)
+	{
+		if(maybe_hot(k))
+		{
+			ATOM* t = hot.find(k);
+			if(t!=hot.end())
+				return t;
+		}
+		return cold.insert_shared(k);
+	}
+
+	/**
+	 * Remove an Atom by pointer, return the next one.
+	 */
+	ATOM* erase(ATOM* t)
+	{
+		if(not hot.owns(t))
+			return cold.erase(t);
+		unmark(t->k & ~ATOM::STATE);
+		t = hot.erase(t);
+		return t!=hot.end() ? t : cold.begin();
+	}
+
+	/**
+	 * Remove an Atom by key.
+	 */
+	bool remove(uint64_t k)
+	{
+		if(maybe_hot(k) and hot.remove(k))
+		{
+			unmark(ATOM::fold(k));
+			return true;
+		}
+		return cold.remove(k);
+	}
+
+	/**
+	 * Remove all the Atom.
+	 */
+	void clear()
+	{
+		hot.clear();
+		cold.clear();
+		if(filter!=NULL)
+		{
+			memset(filter,0,1lu<<(64-filter_shift));
+			sketch->clear();
+		}
+		gen++;
+	}
+
+	/**
+	 * Rehash the cold tier to new_max_len slots, see BigMap::rehash().
+	 */
+	void rehash(I new_max_len)
+	{
+		init_hot();
+		cold.rehash(new_max_len);
+	}
+
+	/**
+	 * Tag of the layout of the image written by dump(), that of BigMap.
+	 */
+	static uint32_t layout() { return MAP::layout(); }
+
+	/**
+	 * Bytes of the image of a map of _max_len slots, see BigMap::image_size().
+	 */
+	static uint64_t image_size(I _max_len, I _dense = 0)
+	{
+		return MAP::image_size(_max_len,_dense);
+	}
+
+	/**
+	 * Write the image of the cold tier to a (opened) file, after
+	 * finish_moving(), see BigMap::dump().
+	 */
+	uint64_t dump(FILE * fo)
+	{
+		finish_moving();
+		return cold.dump(fo);
+	}
+
+	/**
+	 * Use an image written by dump() in place as the cold tier,
+	 * see BigMap::link().
+	 *
+	 * The hot tier starts empty.
+	 */
+	void link(void * mem, I _max_len, I _len, I _vacancy,
+			I _dense = 0, I _dense_len = 0)
+	{
+		init_hot();
+		hot.clear();
+		memset(filter,0,1lu<<(64-filter_shift));
+		sketch->clear();
+		cold.link(mem,_max_len,_len,_vacancy,_dense,_dense_len);
+		gen++;
+	}
+
+	/**
+	 * Save the map to a (opened) file, as BigMap::save().
+	 */
+	uint64_t save(FILE * fo) const
+	{
+		fprintf(fo,"map_size: %lu\n",size());
+		for(auto t=begin();t!=end();t=next(t))
+		{
+			fprintf(fo,"0x%0lx",(uint64_t)(t->k & ~ATOM::STATE));
+			for(uint32_t i=0;i<N;i++)
+				fprintf(fo,"\t%10e",(double)t->v[i]);
+			fprintf(fo,"\n");
+		}
+		return size();
+	}
+
+	/**
+	 * Load from a (opened) file into the cold tier, as BigMap::load().
+	 *
+	 * Discard everything previously stored in the map if any.
+	 */
+	uint64_t load(FILE * fi)
+	{
+		init_hot();
+		hot.clear();
+		memset(filter,0,1lu<<(64-filter_shift));
+		sketch->clear();
+		gen++;
+		return cold.load(fi);
+	}
+
+private:
+	TieredMap(const TieredMap&);
+	TieredMap& operator=(const TieredMap&);
+};
@@ -0,0 +1,188 @@
+/**
+ * @file vmath.hpp
+ * @brief Logistic loss and gradient of a batch, exact or fast (AVX2).
+ * @author linus
+ * @version 1.0
+ * @date 2013-10-03
+ */
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VMATH_X86 1
+#endif
+
+/**
+ * exp(x) for x in [-708,0], by a polynomial.
+ *
+ * \f$ e^x = 2^k e^r \f$, \f$ |r| \le \ln 2/2 \f$, and \f$e^r\f$ by its
+ * Taylor series to \f$r^7\f$. The relative error is below 1e-8.
+ * Smaller x is taken as -708.
+ */
+inline double fast_exp(double x)
+{
+	x = x<-708?-708:x;
+	const double k = nearbyint(x*1.4426950408889634);
+	const double r = (x-k*6.93145751953125e-1)-k*1.42860682030941723212e-6;
+	double p = 1.0/5040;
+	p = p*r+1.0/720;
+	p = p*r+1.0/120;
+	p = p*r+1.0/24;
+	p = p*r+1.0/6;
+	p = p*r+0.5;
+	p = p*r+1;
+	p = p*r+1;
+	const uint64_t bits = (uint64_t)((int64_t)k+1023)<<52;
+	double s;
+	memcpy(&s,&bits,sizeof(s));
+	return p*s;
+}
+
+/**
+ * log(1+u) for u in [0,1], by a polynomial.
+ *
+ * \f$ \log(1+u) = 2\,\mathrm{atanh}(z) \f$, \f$ z = u/(2+u) \le 1/3 \f$,
+ * by its series to \f$z^{13}\f$. The relative error is below 2e-8.
+ */
+inline double fast_log1p(double u)
+{
+	const double z = u/(2+u);
+	const double z2 = z*z;
+	double p = 1.0/13;
+	p = p*z2+1.0/11;
+	p = p*z2+1.0/9;
+	p = p*z2+1.0/7;
+	p = p*z2+1.0/5;
+	p = p*z2+1.0/3;
+	p = p*z2+1;
+	return 2*z*p;
+}
+
+/**
+ * Logistic loss and gradient of one Sample, see logistic_batch().
+ */
+inline void logistic_one(double f, double y, double w, double& g, double& loss,
+		bool fast)
+{
+	const double m = y*f;
+	const double e = fast?fast_exp(-fabs(m)):exp(-fabs(m));
+	const double q = 1/(1+e);
+	g = w*(m>=0?-e*q:-q)*y;
+	loss = (m<0?-m:0)+(fast?fast_log1p(e):log1p(e));
+}
+
+#ifdef VMATH_X86
+/**
+ * fast_exp() of 4 doubles.
+ */
+__attribute__((target("avx2,fma")))
+inline __m256d fast_exp_avx2(__m256d x)
+{
+	x = _mm256_max_pd(x,_mm256_set1_pd(-708));
+	const __m256d k = _mm256_round_pd(_mm256_mul_pd(x,_mm256_set1_pd(1.4426950408889634)),
+			_MM_FROUND_TO_NEAREST_INT|_MM_FROUND_NO_EXC);
+	__m256d r = _mm256_fnmadd_pd(k,_mm256_set1_pd(6.93145751953125e-1),x);
+	r = _mm256_fnmadd_pd(k,_mm256_set1_pd(1.42860682030941723212e-6),r);
+	__m256d p = _mm256_set1_pd(1.0/5040);
+	p = _mm256_fmadd_pd(p,r,_mm256_set1_pd(1.0/720));
+	p = _mm256_fmadd_pd(p,r,_mm256_set1_pd(1.0/120));
+	p = _mm256_fmadd_pd(p,r,_mm256_set1_pd(1.0/24));
+	p = _mm256_fmadd_pd(p,r,_mm256_set1_pd(1.0/6));
+	p = _mm256_fmadd_pd(p,r,_mm256_set1_pd(0.5));
+	p = _mm256_fmadd_pd(p,r,_mm256_set1_pd(1));
+	p = _mm256_fmadd_pd(p,r,_mm256_set1_pd(1));
+	// k+1.5*2^52 has k in its low bits, the shift drops the rest
+	__m256i b = _mm256_castpd_si256(_mm256_add_pd(k,_mm256_set1_pd(6755399441055744.0)));
+	b = _mm256_slli_epi64(_mm256_add_epi64(b,_mm256_set1_epi64x(1023)),52);
+	return _mm256_mul_pd(p,_mm256_castsi256_pd(b));
+}
+
+/**
+ * fast_log1p() of 4 doubles.
+ */
+__attribute__((target("avx2,fma")))
+inline __m256d fast_log1p_avx2(__m256d u)
+{
+	const __m256d z = _mm256_div_pd(u,_mm256_add_pd(u,_mm256_set1_pd(2)));
+	const __m256d z2 = _mm256_mul_pd(z,z);
+	__m256d p = _mm256_set1_pd(1.0/13);
+	p = _mm256_fmadd_pd(p,z2,_mm256_set1_pd(1.0/11));
+	p = _mm256_fmadd_pd(p,z2,_mm256_set1_pd(1.0/9));
+	p = _mm256_fmadd_pd(p,z2,_mm256_set1_pd(1.0/7));
+	p = _mm256_fmadd_pd(p,z2,_mm256_set1_pd(1.0/5));
+	p = _mm256_fmadd_pd(p,z2,_mm256_set1_pd(1.0/3));
+	p = _mm256_fmadd_pd(p,z2,_mm256_set1_pd(1));
+	return _mm256_mul_pd(_mm256_add_pd(z,z),p);
+}
+
+/**
+ * logistic_batch() in fast mode, 4 Sample at a time.
+ */
+__attribute__((target("avx2,fma")))
+inline void logistic_batch_avx2(const double* f, const double* y, const double* w,
+		double* g, double* loss, uint32_t n)
+{
+	const __m256d zero = _mm256_setzero_pd();
+	const __m256d one = _mm256_set1_pd(1);
+	uint32_t i = 0;
+	for(;i+4<=n;i+=4)
+	{
+		const __m256d yy = _mm256_loadu_pd(y+i);
+		const __m256d m = _mm256_mul_pd(yy,_mm256_loadu_pd(f+i));
+		const __m256d neg_m = _mm256_sub_pd(zero,m);
+		const __m256d e = fast_exp_avx2(_mm256_min_pd(m,neg_m)); // exp(-|m|)
+		const __m256d q = _mm256_div_pd(one,_mm256_add_pd(one,e));
+		// p-1 is -e*q for m >= 0 and -q for m < 0
+		const __m256d eq = _mm256_blendv_pd(_mm256_mul_pd(e,q),q,
+				_mm256_cmp_pd(m,zero,_CMP_LT_OQ));
+		const __m256d d = _mm256_mul_pd(_mm256_loadu_pd(w+i),_mm256_mul_pd(eq,yy));
+		_mm256_storeu_pd(g+i,_mm256_sub_pd(zero,d));
+		_mm256_storeu_pd(loss+i,_mm256_add_pd(_mm256_max_pd(neg_m,zero),fast_log1p_avx2(e)));
+	}
+	for(;i<n;i++)
+		logistic_one(f[i],y[i],w[i],g[i],loss[i],true);
+}
+#endif
+
+/**
+ * Whether logistic_batch() can use AVX2 on this CPU.
+ */
+inline bool vmath_avx2()
+{
+#ifdef VMATH_X86
+	static const bool yes = __builtin_cpu_supports("avx2") and __builtin_cpu_supports("fma");
+	return yes;
+#else
+	return false;
+#endif
+}
+
+/**
+ * Logistic loss and gradient of a batch of n Sample.
+ *
+ * For each i, with \f$ m = y_i f_i \f$ and \f$ p = 1/(1+\exp(-m)) \f$,
+ * \f[
+ * 		g_i = w_i (p-1) y_i, \quad loss_i = \log(1+\exp(-m))
+ * \f]
+ * both from \f$\exp(-|m|)\f$, so they do not overflow.
+ * If fast, exp() and log1p() are fast_exp() and fast_log1p(),
+ * 4 Sample at a time if the CPU has AVX2 and FMA, see vmath_avx2().
+ * Otherwise they are those of libm.
+ */
+inline void logistic_batch(const double* f, const double* y, const double* w,
+		double* g, double* loss, uint32_t n, bool fast)
+{
+#ifdef VMATH_X86
+	if(fast and vmath_avx2())
+	{
+		logistic_batch_avx2(f,y,w,g,loss,n);
+		return;
+	}
+#endif
+	for(uint32_t i=0;i<n;i++)
+		logistic_one(f[i],y[i],w[i],g[i],loss[i],fast);
+}
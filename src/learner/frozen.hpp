@@ -0,0 +1,448 @@
+/**
+ * @file frozen.hpp
+ * @brief Read-only model for serving, frozen from a learner.
+ * @author linus
+ * @version 1.0
+ * @date 2013-10-03
+ */
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <utility>
+extern "C" {
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+}
+
+#include "headers/hash.hpp"
+#include "headers/bigmap2.hpp"
+#include "headers/half.hpp"
+#include "headers/alloc.hpp"
+#include "headers/datatype.hpp"
+#include "headers/error.hpp"
+
+/**
+ * File format of a frozen model, see Frozen_T::save().
+ *
+ * A FrozenHead, the FrozenTable of each table, the scale of each space,
+ * then the data of the tables, starting at FrozenHead::data.
+ */
+#define FROZEN_MAGIC 0x5a46524cu // "LRFZ"
+#define FROZEN_VERSION 2
+#define FROZEN_ALIGN 4096
+#define FROZEN_LOAD 0.8 ///< keys per home slot of a table
+#define FROZEN_EMPTY (~0lu) ///< key of an empty slot
+#define FROZEN_BATCH 16 ///< Feature hashed and prefetched at once by Frozen_T::predict()
+
+/**
+ * Head of a frozen model.
+ */
+typedef struct
+{
+	uint32_t magic; ///< FROZEN_MAGIC
+	uint32_t version; ///< FROZEN_VERSION
+	uint32_t value_size; ///< sizeof() the value
+	uint32_t key_bits; ///< Atom::KEY_BITS of the learner
+	uint32_t n_space; ///< number of feature space
+	uint32_t merged; ///< 1 if one table for all spaces, else a table for each
+	double intercept; ///< intercept
+	uint64_t data; ///< where the data starts
+	uint64_t data_len; ///< length of the data
+} FrozenHead;
+
+/**
+ * A table of a frozen model, as offsets in the data.
+ */
+typedef struct
+{
+	uint64_t size; ///< number of keys
+	uint64_t home; ///< number of home slots
+	uint64_t len; ///< number of slots, the last 4 are empty
+	uint64_t key; ///< where the keys start
+	uint64_t value; ///< where the values start
+} FrozenTable;
+
+/**
+ * Store a weight w as a value v of scale. (int8 is rounded, see to_int8())
+ */
+template <typename V>
+inline void frozen_store(V& v, float w, float scale) { v = V(w); }
+inline void frozen_store(int8_t& v, float w, float scale) { v = to_int8(w,scale); }
+
+/**
+ * Read-only logistic regression model, for predict() only.
+ *
+ * freeze() compiles the weights of a trained LR_Learner_T or
+ * FTRL_Learner_T into a table for each space, or one table for all
+ * of them if merged. The weights of 0 are dropped, and the table has
+ * FROZEN_LOAD keys per home slot and no state bits or v[1]:
+ * an array of keys, and one of values of type V (float, fp16, bf16,
+ * or int8_t times a scale of the space, see freeze()).
+ *
+ * A key is stored as fmix() of its folded key, which is one to one.
+ * They are placed in increasing order from their home slots
+ * (key*home/2**64), with empty slots of FROZEN_EMPTY between, so a
+ * lookup scans from the home slot while the keys are smaller, and a
+ * miss stops as early as a hit. It never wraps around: the table ends
+ * after the last key or the last home slot, whichever is later, with
+ * 4 empty slots.
+ *
+ * In a merged table, a key is fmix() of the folded key xor'ed with
+ * fmix() of the space, so keys of two spaces may collide, as likely
+ * as two random 64-bit keys.
+ *
+ * save() writes it to a file, which load() maps and uses in place.
+ */
+template <typename V = float>
+class Frozen_T
+{
+public:
+	typedef V VALUE;
+
+protected:
+	/**
+	 * Where a table is, see link().
+	 */
+	struct Part
+	{
+		const uint64_t* key; ///< keys
+		const V* value; ///< values
+		uint64_t home; ///< number of home slots
+	};
+
+	uint32_t key_bits; ///< Atom::KEY_BITS of the learner, see fold()
+	uint32_t n_space; ///< number of feature space
+	bool merged; ///< one table for all spaces
+	double intercept; ///< intercept
+	std::vector<FrozenTable> table; ///< tables, n_space or 1 if merged
+	std::vector<float> scale; ///< scale of the values of each space
+	std::vector<uint64_t> salt; ///< of each space in a merged table, see hash()
+	std::vector<Part> part; ///< each table in data
+	char * data; ///< keys and values of the tables
+	uint64_t data_len; ///< length of data
+	uint32_t alloc; ///< policy of big_alloc() for data, see freeze()
+	char * file; ///< mapped by load(), holding data
+	uint64_t file_len; ///< length of file
+
+public:
+	Frozen_T(): key_bits(62), n_space(0), merged(false), intercept(0),
+		data(NULL), data_len(0), alloc(ALLOC_PLAIN), file(NULL), file_len(0) {}
+
+	~Frozen_T() { clear(); }
+
+	/**
+	 * Return the number of feature space.
+	 */
+	uint32_t size() const { return n_space; }
+
+	/**
+	 * Return the number of weights.
+	 */
+	uint64_t weights() const
+	{
+		uint64_t n = 0;
+		for(auto t=table.begin();t!=table.end();++t)
+			n += t->size;
+		return n;
+	}
+
+	/**
+	 * Return the bytes of the keys and values.
+	 */
+	uint64_t bytes() const { return data_len; }
+
+	/**
+	 * Freeze the weights of a learner.
+	 *
+	 * LEARNER is LR_Learner_T or FTRL_Learner_T, whose weight() of
+	 * each Atom is taken, so it should be weighable(): a loaded
+	 * FTRL_Learner_T needs set_param() first. For an int8_t V, the
+	 * scale of a space is int8_scale() of its largest |weight|, and the
+	 * weights rounded to 0 are dropped too.
+	 *
+	 * @param _merged one table for all spaces
+	 * @param _alloc policy of big_alloc() for the tables
+	 */
+	template <class LEARNER>
+	void freeze(const LEARNER& l, bool _merged = false, uint32_t _alloc = ALLOC_PLAIN)
+	{
+		typedef typename LEARNER::ATOM ATOM;
+		if(not l.weighable())
+			error("Cannot freeze a learner without its Parameter, set_param() it first.\n");
+		clear();
+		key_bits = ATOM::KEY_BITS;
+		n_space = l.size();
+		merged = _merged;
+		intercept = l.bias();
+		alloc = _alloc;
+		scale.assign(n_space,1);
+		set_salt();
+		std::vector<std::vector<std::pair<uint64_t,V> > > kv(merged?1:n_space);
+		for(uint32_t i=0;i<n_space;i++)
+		{
+			if(sizeof(V)==1)
+			{
+				float max_abs = 0;
+				for(auto t=l.m[i].begin();t!=l.m[i].end();t=l.m[i].next(t))
+					max_abs = std::max(max_abs,fabsf(l.weight(*t)));
+				scale[i] = int8_scale(max_abs);
+			}
+			auto& out = kv[merged?0:i];
+			for(auto t=l.m[i].begin();t!=l.m[i].end();t=l.m[i].next(t))
+			{
+				V v;
+				frozen_store(v,l.weight(*t),scale[i]);
+				if((float)v==0)
+					continue;
+				const uint64_t h = hash(i,t->k & ~ATOM::STATE);
+				if(h==FROZEN_EMPTY) // one key in 2**64
+				{
+					warning("Key 0x%lx of space %u is dropped.\n",
+							(uint64_t)(t->k & ~ATOM::STATE),i);
+					continue;
+				}
+				out.push_back(std::make_pair(h,v));
+			}
+		}
+		table.resize(kv.size());
+		data_len = 0;
+		for(uint32_t i=0;i<kv.size();i++)
+		{
+			std::sort(kv[i].begin(),kv[i].end(),less_key);
+			FrozenTable& t = table[i];
+			t.size = kv[i].size();
+			t.home = (uint64_t)ceil(t.size/FROZEN_LOAD)+1;
+			uint64_t last = 0;
+			for(uint64_t j=0;j<t.size;j++)
+				last = std::max(slot(kv[i][j].first,t.home),j>0?last+1:0);
+			t.len = std::max(last+1,t.home)+4; // lookup() reads 4 from any home slot
+			t.key = align(data_len);
+			t.value = align(t.key+t.len*sizeof(uint64_t));
+			data_len = t.value+t.len*sizeof(V);
+		}
+		data_len = align(data_len);
+		data = (char*)big_alloc(data_len,alloc);
+		if(data==NULL)
+			error("Failed to allocate %lu bytes for a frozen model.\n",data_len);
+		for(uint32_t i=0;i<kv.size();i++)
+		{
+			const FrozenTable& t = table[i];
+			uint64_t* key = (uint64_t*)(data+t.key);
+			V* value = (V*)(data+t.value);
+			std::fill(key,key+t.len,FROZEN_EMPTY);
+			uint64_t j = 0;
+			for(uint64_t n=0;n<t.size;n++)
+			{
+				j = std::max(slot(kv[i][n].first,t.home),n>0?j+1:0);
+				key[j] = kv[i][n].first;
+				value[j] = kv[i][n].second;
+			}
+		}
+		link();
+	}
+
+	/**
+	 * Weight of key k of a space.
+	 */
+	inline float weight(uint32_t space, uint64_t k) const
+	{
+		const uint64_t h = hash(space,k);
+		const Part& t = part[merged?0:space];
+		return lookup(t,h,slot(h,t.home))*(sizeof(V)==1?scale[space]:1);
+	}
+
+	/**
+	 * Make prediction on Sample s, see LR_Learner_T::predict().
+	 *
+	 * The Feature are hashed and their home slots prefetched
+	 * FROZEN_BATCH at a time, then looked up, so the cache misses
+	 * overlap. (It keeps nothing in the object, so threads can share it.)
+	 */
+	inline double predict(const Sample& s) const
+	{
+		double f = intercept;
+		uint64_t h[FROZEN_BATCH];
+		uint64_t j[FROZEN_BATCH];
+		for(uint32_t a=0;a<s.len;a+=FROZEN_BATCH)
+		{
+			const uint32_t b = std::min(s.len,a+FROZEN_BATCH);
+			for(uint32_t x=a;x<b;x++)
+			{
+				const Feature& p = s.x[x];
+				if(p.space >= n_space)
+					continue;
+				const Part& t = part[merged?0:p.space];
+				h[x-a] = hash(p.space,p.key);
+				j[x-a] = slot(h[x-a],t.home);
+				__builtin_prefetch(t.key+j[x-a]);
+				__builtin_prefetch(t.value+j[x-a]);
+			}
+			for(uint32_t x=a;x<b;x++)
+			{
+				const Feature& p = s.x[x];
+				if(p.space < n_space)
+					f += lookup(part[merged?0:p.space],h[x-a],j[x-a])
+						*(sizeof(V)==1?scale[p.space]:1)*p.value;
+			}
+		}
+		return f;
+	}
+
+	/**
+	 * Save to a file, see FrozenHead.
+	 */
+	void save(const char * filename) const
+	{
+		info("Save to %s\n",filename);
+		FILE * fo = fopen(filename,"wb");
+		if(!fo)
+			error("Failed to open %s for writing.\n",filename);
+		const uint64_t start = (sizeof(FrozenHead)+table.size()*sizeof(FrozenTable)
+				+n_space*sizeof(float)+FROZEN_ALIGN-1)/FROZEN_ALIGN*FROZEN_ALIGN;
+		FrozenHead head = {FROZEN_MAGIC,FROZEN_VERSION,sizeof(V),key_bits,
+			n_space,merged,intercept,start,data_len};
+		qassert(1==fwrite(&head,sizeof(head),1,fo));
+		qassert(table.size()==fwrite(table.data(),sizeof(FrozenTable),table.size(),fo));
+		qassert(n_space==fwrite(scale.data(),sizeof(float),n_space,fo));
+		qassert(0==fseek(fo,start,SEEK_SET));
+		qassert(data_len==fwrite(data,1,data_len,fo));
+		fclose(fo);
+	}
+
+	/**
+	 * Load from a file written by save().
+	 *
+	 * The file is mapped and used in place, so it takes no time to load.
+	 */
+	void load(const char * filename)
+	{
+		int fd = open(filename,O_RDONLY);
+		if(fd<0)
+			error("Failed to load from %s.\n",filename);
+		info("Load from %s\n",filename);
+		const uint64_t len = lseek(fd,0,SEEK_END);
+		if(len<sizeof(FrozenHead))
+			error("%s is not a frozen model.\n",filename);
+		char * mem = (char*)mmap(NULL,len,PROT_READ,MAP_PRIVATE,fd,0);
+		close(fd);
+		if(mem==MAP_FAILED)
+			error("Failed to mmap %s.\n",filename);
+		const FrozenHead* head = (const FrozenHead*)mem;
+		if(head->magic!=FROZEN_MAGIC or head->version!=FROZEN_VERSION)
+			error("%s is not a frozen model of version %u.\n",filename,FROZEN_VERSION);
+		if(head->value_size!=sizeof(V))
+			error("%s has values of %u bytes, expect %lu.\n",
+					filename,head->value_size,sizeof(V));
+		qassert(head->data+head->data_len<=len);
+		clear();
+		file = mem;
+		file_len = len;
+		key_bits = head->key_bits;
+		n_space = head->n_space;
+		merged = head->merged;
+		intercept = head->intercept;
+		const FrozenTable* t = (const FrozenTable*)(head+1);
+		table.assign(t,t+(merged?1:n_space));
+		const float* sc = (const float*)(t+table.size());
+		scale.assign(sc,sc+n_space);
+		set_salt();
+		data = mem+head->data;
+		data_len = head->data_len;
+		link();
+	}
+
+protected:
+	/**
+	 * Value of stored key h in table t, from its home slot j, 0 if missing.
+	 *
+	 * The keys from j are sorted, so the number of them below h among
+	 * the first 4 tells where h is, if it is that near.
+	 */
+	static inline float lookup(const Part& t, uint64_t h, uint64_t j)
+	{
+		const uint64_t* k = t.key+j;
+		const uint64_t n = (k[0]<h)+(k[1]<h)+(k[2]<h)+(k[3]<h); // no branch to mispredict
+		if(n<4)
+			j += n;
+		else
+			for(j+=4;t.key[j]<h;j++);
+		return t.key[j]==h?(float)t.value[j]:0;
+	}
+
+	/**
+	 * Key k of a space as stored, see Atom::fold().
+	 */
+	inline uint64_t hash(uint32_t space, uint64_t k) const
+	{
+		k &= ~(3lu<<62);
+		if(key_bits<62 and k>=(1lu<<key_bits))
+			k = fmix(k)>>(64-key_bits);
+		return fmix(merged?k^salt[space]:k);
+	}
+
+	/**
+	 * Home slot of a stored key h, among home slots.
+	 */
+	static inline uint64_t slot(uint64_t h, uint64_t home)
+	{
+		return (uint64_t)(((__uint128_t)h*home)>>64);
+	}
+
+	/**
+	 * Order of (key,value) by key.
+	 */
+	static bool less_key(const std::pair<uint64_t,V>& a, const std::pair<uint64_t,V>& b)
+	{
+		return a.first<b.first;
+	}
+
+	/**
+	 * Round an offset up to a cache line.
+	 */
+	static inline uint64_t align(uint64_t offset) { return (offset+63)/64*64; }
+
+	/**
+	 * Set salt of each space.
+	 */
+	void set_salt()
+	{
+		salt.resize(n_space);
+		for(uint32_t i=0;i<n_space;i++)
+			salt[i] = fmix((uint64_t)i+1);
+	}
+
+	/**
+	 * Point part into data.
+	 */
+	void link()
+	{
+		part.resize(table.size());
+		for(uint32_t i=0;i<table.size();i++)
+			part[i] = {(const uint64_t*)(data+table[i].key),
+				(const V*)(data+table[i].value),table[i].home};
+	}
+
+	/**
+	 * Free the tables, or unmap the file.
+	 */
+	void clear()
+	{
+		if(file!=NULL)
+			munmap(file,file_len);
+		else if(data!=NULL)
+			big_free(data,data_len,alloc);
+		file = NULL;
+		data = NULL;
+		data_len = 0;
+		table.clear();
+		part.clear();
+	}
+};
+
+typedef Frozen_T<> Frozen;
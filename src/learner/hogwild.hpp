@@ -0,0 +1,229 @@
+/**
+ * @file hogwild.hpp
+ * @brief Lock-free multi-threaded training for LR_Learner.
+ * @author linus
+ * @version 1.0
+ * @date 2013-10-03
+ */
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+extern "C"
+{
+#include <pthread.h>
+}
+
+#include "headers/error.hpp"
+#include "headers/time.hpp"
+#include "headers/lcg64.hpp"
+#include "headers/datatype.hpp"
+#include "learner/logistic_trsgd.hpp"
+
+/**
+ * Train a LR_Learner with several threads. (Hogwild!)
+ *
+ * Each worker thread reads Sample from its own FEEDER and calls
+ * LR_Learner::digest_shared(), so all of them read and write the
+ * shared weights without any lock, see
+ * [Hogwild!](http://arxiv.org/abs/1106.5730).
+ *
+ * The work which needs the whole map (truncate() and rehash) cannot be
+ * done that way. When it is due, every worker stops at the beginning of its
+ * next Sample, the last one to stop does LR_Learner::maintain(), and then all
+ * of them go on. Between two stops the only shared write besides the weights
+ * is an atomic add on LR_Learner::iter.
+ *
+ * Convergence/throughput trade-off:
+ * 1. With T threads, a weight may be read up to T-1 updates late, and
+ *    two updates of the same weight at the same time may lose one of them.
+ *    Since a Sample only touches ~100 out of millions of weights, this is
+ *    rare except for the intercept and the small spaces (hour, weekday, os,
+ *    adex), whose weights are dense and also the first to converge.
+ *    Expect the loss curve of T threads to lag a bit behind the single
+ *    thread one at the same iter, not to differ at the end.
+ * 2. Throughput grows with T until the memory bandwidth is saturated,
+ *    and drops a little with a small K, since every truncate() stops all
+ *    the threads for one sweep of the maps.
+ *    The throughput is reported at the end of run(), run it with
+ *    T = 1,2,4,...,32 to get the scaling of your machine.
+ * 3. The result is not deterministic, even with the same seed.
+ */
+template <class FEEDER, class LEARNER = LR_Learner>
+class Hogwild
+{
+public:
+	typedef void (*LABEL)(Sample&); ///< set y and wt for a fed Sample
+
+private:
+	LEARNER& l; ///< the shared learner
+	LABEL label; ///< label function
+	uint64_t n_iter; ///< number of Sample to digest in all
+	uint64_t n_fed; ///< number of Sample taken by workers
+	volatile bool pending; ///< whether some worker asks for maintenance
+	uint32_t n_active; ///< number of running workers
+	uint32_t n_parked; ///< number of workers waiting in park()
+	uint64_t generation; ///< number of maintenance done
+	pthread_mutex_t mutex; ///< protects all above and the stat in l
+	pthread_cond_t cond; ///< wake up the parked workers
+
+	/**
+	 * Argument of a worker thread.
+	 */
+	typedef struct
+	{
+		Hogwild* h; ///< who starts the thread
+		FEEDER* f; ///< its own feeder
+		uint32_t id; ///< thread id
+	} Worker;
+
+public:
+	Hogwild(LEARNER& _l):
+		l(_l), label(NULL), n_iter(0), n_fed(0), pending(false),
+		n_active(0), n_parked(0), generation(0)
+	{
+		pthread_mutex_init(&mutex,NULL);
+		pthread_cond_init(&cond,NULL);
+	}
+
+	~Hogwild()
+	{
+		pthread_cond_destroy(&cond);
+		pthread_mutex_destroy(&mutex);
+	}
+
+	/**
+	 * Digest n_iter Sample with feeders.size() threads.
+	 *
+	 * Print the statistics every print_sec seconds.
+	 * Return the number of Sample digested per second.
+	 */
+	double run(std::vector<FEEDER*>& feeders, uint64_t _n_iter, LABEL _label,
+			double print_sec = 1.0)
+	{
+		const uint32_t n_thread = feeders.size();
+		qassert(n_thread>0);
+		l.set_param(l.par); // checked once, before the threads share it
+		label = _label;
+		n_iter = _n_iter;
+		n_fed = 0;
+		n_active = n_thread;
+		n_parked = 0;
+		std::vector<pthread_t> tid(n_thread);
+		std::vector<Worker> arg(n_thread);
+		struct timespec spec_a,spec_b;
+		clock_gettime(CLOCK_REALTIME, &spec_a);
+		for(uint32_t i=0;i<n_thread;i++)
+		{
+			arg[i] = {this,feeders[i],i};
+			if(0!=pthread_create(&tid[i],NULL,work,&arg[i]))
+				error("pthread_create() failed for thread %u.\n",i);
+		}
+		while(true)
+		{
+			qsleep(print_sec);
+			pthread_mutex_lock(&mutex);
+			bool done = (n_active==0);
+			if(not done)
+				l.print();
+			pthread_mutex_unlock(&mutex);
+			if(done)
+				break;
+		}
+		for(uint32_t i=0;i<n_thread;i++)
+			pthread_join(tid[i],NULL);
+		l.maintain();
+		clock_gettime(CLOCK_REALTIME, &spec_b);
+		double dsec = spec_b.tv_sec-spec_a.tv_sec;
+		dsec += 1e-9*(spec_b.tv_nsec-spec_a.tv_nsec);
+		const double speed = n_iter/dsec;
+		info("%u threads: %lu samples in %.3lf sec, %.0lf samples/sec.\n",
+				n_thread,n_iter,dsec,speed);
+		return speed;
+	}
+
+private:
+	/**
+	 * Entrance of worker threads.
+	 */
+	static void* work(void * _arg)
+	{
+		Worker* w = (Worker*)_arg;
+		w->h->loop(w->f,w->id);
+		return NULL;
+	}
+
+	/**
+	 * Main loop of a worker.
+	 */
+	void loop(FEEDER* f, uint32_t id)
+	{
+		lcg64(get_nsec()+id*A_LEcuyer1);
+		Sample s(512);
+		double sum_loss = 0;
+		double sum_wt = 0;
+		for(uint64_t count=1;;count++)
+		{
+			if(pending)
+				park();
+			if(__sync_add_and_fetch(&n_fed,1) > n_iter)
+				break;
+			f->feed(s);
+			label(s);
+			double loss;
+			bool sync = false;
+			l.digest_shared(s,loss,sync);
+			sum_loss += s.wt*loss;
+			sum_wt += s.wt;
+			if(sync)
+				pending = true;
+			if(count % (1<<14) == 0)
+			{
+				pthread_mutex_lock(&mutex);
+				l.sum_loss += sum_loss;
+				l.sum_wt += sum_wt;
+				pthread_mutex_unlock(&mutex);
+				sum_loss = sum_wt = 0;
+			}
+		}
+		pthread_mutex_lock(&mutex);
+		l.sum_loss += sum_loss;
+		l.sum_wt += sum_wt;
+		n_active--;
+		if(n_active>0 and n_parked==n_active)
+			maintain();
+		pthread_mutex_unlock(&mutex);
+	}
+
+	/**
+	 * Wait until all the workers stop, the last one does the maintenance.
+	 */
+	void park()
+	{
+		pthread_mutex_lock(&mutex);
+		n_parked++;
+		if(n_parked==n_active)
+			maintain();
+		else
+		{
+			const uint64_t g = generation;
+			while(g==generation)
+				pthread_cond_wait(&cond,&mutex);
+		}
+		pthread_mutex_unlock(&mutex);
+	}
+
+	/**
+	 * Maintain the learner and wake up everyone. (mutex should be locked)
+	 */
+	void maintain()
+	{
+		l.maintain();
+		pending = false;
+		n_parked = 0;
+		generation++;
+		pthread_cond_broadcast(&cond);
+	}
+};
+
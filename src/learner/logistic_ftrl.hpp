@@ -0,0 +1,174 @@
+/**
+ * @file logistic_ftrl.hpp
+ * @brief Logistic regression with FTRL-Proximal.
+ * @author linus
+ * @version 1.0
+ * @date 2013-10-03
+ */
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+
+#include "headers/half.hpp"
+#include "headers/datatype.hpp"
+#include "headers/error.hpp"
+#include "learner/logistic_trsgd.hpp"
+
+/**
+ * Logistic Regression Learner by FTRL-Proximal
+ *
+ * See [Ad Click Prediction: a View from the Trenches]
+ * (http://research.google.com/pubs/archive/41159.pdf).
+ * Each weight keeps \f$z\f$ in ATOM::v[0] and \f$n\f$ (the sum of its
+ * squared gradients) in ATOM::v[1], and the weight itself is computed
+ * from them when it is used, see weight(). It is exactly 0 while
+ * \f$|z| \le \lambda_1\f$, so the model is sparse without any sweep
+ * like LR_Learner_T::truncate(), and the step size of each weight
+ * shrinks with its own gradients, so the rare keys learn fast.
+ *
+ * It is LR_Learner_T with its own weight(), step(), step_intercept(),
+ * step_scale() and truncate(), see LR_Learner_T::self(), so it shares
+ * its digest paths, maps, snapshots and options: set_admission() keeps
+ * the keys seen once out of the maps (the probabilistic inclusion of the
+ * paper), and set_cap() evicts the least \f$|z|\f$ first, mostly
+ * weights of 0. The saved
+ * models keep \f$z\f$ and \f$n\f$, so the training can go on from them.
+ * The parameters are Parameter::alpha, beta, l1 and l2, and lazy and
+ * adagrad should be 0, since v[1] is taken. The intercept is updated by AdaGrad,
+ * its sum of squared gradients is kept by save_binary() only.
+ */
+template <class MAP = BigMap<2,float> >
+class FTRL_Learner_T: public LR_Learner_T<MAP,FTRL_Learner_T<MAP> >
+{
+public:
+	typedef LR_Learner_T<MAP,FTRL_Learner_T<MAP> > BASE;
+	typedef typename BASE::ATOM ATOM;
+	typedef typename BASE::BIGMAP BIGMAP;
+	friend BASE;
+
+	/**
+	 * Constructor
+	 *
+	 * @param _n_space number of feature space
+	 */
+	FTRL_Learner_T(uint32_t _n_space, uint32_t _max_n_space = 256):
+		BASE(_n_space,_max_n_space)
+	{
+		this->keep_sum = true;
+	}
+
+	/**
+	 * Weight of an Atom, from its \f$z\f$ and \f$n\f$.
+	 *
+	 * \f[
+	 * 		w = \left\{\begin{array}{cc} 0 & |z| \le \lambda_1 \\
+	 * 		-\frac{z-\mathrm{sgn}(z)\lambda_1}{(\beta+\sqrt{n})/\alpha+\lambda_2} & other
+	 * 		\end{array}\right.
+	 * \f]
+	 */
+	inline float weight(const ATOM& a) const
+	{
+		const Parameter* par = this->par;
+		const double z = a.v[0];
+		if(fabs(z) <= par->l1)
+			return 0;
+		return -(z-copysign(par->l1,z))/((par->beta+sqrt((double)a.v[1]))/par->alpha+par->l2);
+	}
+
+	/**
+	 * Whether weight() can be taken now: it needs par, see set_param().
+	 */
+	bool weighable() const { return this->par!=NULL; }
+
+	/**
+	 * Number of weights not 0, in all the spaces.
+	 *
+	 * It goes through all the maps, so it is for statistics.
+	 */
+	uint64_t nonzeros() const
+	{
+		uint64_t n = 0;
+		for(uint32_t i=0;i<this->n_space;i++)
+			for(auto t=this->m[i].begin();t!=this->m[i].end();t=this->m[i].next(t))
+				if(weight(*t)!=0)
+					n++;
+		return n;
+	}
+
+	/**
+	 * Quantize the weights to int8 for serving, see LR_Learner_T::quantize().
+	 *
+	 * A weight becomes scale[i]*q by setting its \f$z\f$ for that,
+	 * and the Atom of a weight of 0 is erased.
+	 */
+	std::vector<float> quantize()
+	{
+		const Parameter* par = this->par;
+		std::vector<float> scale(this->n_space);
+		for(uint32_t i=0;i<this->n_space;i++)
+		{
+			BIGMAP& mm = this->m[i];
+			float max_abs = 0;
+			for(auto t=mm.begin();t!=mm.end();t=mm.next(t))
+				if(fabsf(weight(*t))>max_abs)
+					max_abs = fabsf(weight(*t));
+			scale[i] = int8_scale(max_abs);
+			for(auto t=mm.begin();t!=mm.end();)
+			{
+				const int8_t q = to_int8(weight(*t),scale[i]);
+				if(q==0)
+				{
+					t = mm.erase(t);
+					continue;
+				}
+				const double w = scale[i]*q;
+				const double r = (par->beta+sqrt((double)t->v[1]))/par->alpha+par->l2;
+				t->v[0] = -(w*r+copysign(par->l1,w));
+				t = mm.next(t);
+			}
+		}
+		return scale;
+	}
+
+protected:
+	/**
+	 * Factor of the gradient, 1: the step size of each weight is in step().
+	 */
+	inline double step_scale(double e) const { return 1; }
+
+	/**
+	 * Move the intercept by gradient g, by AdaGrad.
+	 */
+	inline void step_intercept(double g)
+	{
+		this->intercept_n += g*g;
+		this->intercept -= this->par->alpha*g/(this->par->beta+sqrt(this->intercept_n));
+	}
+
+	/**
+	 * Move \f$z\f$ and \f$n\f$ of an Atom by gradient g.
+	 *
+	 * \f[
+	 * 		\sigma = \frac{\sqrt{n+g^2}-\sqrt{n}}{\alpha},\quad
+	 * 		z = z + g - \sigma w,\quad n = n + g^2
+	 * \f]
+	 */
+	inline void step(ATOM& a, double g) const
+	{
+		const double n = a.v[1];
+		const double sigma = (sqrt(n+g*g)-sqrt(n))/this->par->alpha;
+		const double w = weight(a);
+		store(a.v[0],a.v[0]+g-sigma*w);
+		store(a.v[1],n+g*g);
+	}
+
+	/**
+	 * Nothing to do, a weight is 0 while \f$|z| \le \lambda_1\f$.
+	 */
+	inline void truncate() {}
+};
+
+typedef FTRL_Learner_T<> FTRL_Learner;
@@ -11,8 +11,23 @@
 #include <cstdlib>
 #include <cmath>
 #include <cassert>
+#include <vector>
+#include <type_traits>
+
+extern "C"
+{
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+}
 
 #include "headers/bigmap2.hpp"
+#include "headers/swissmap.hpp"
+#include "headers/segmap.hpp"
+#include "headers/tiermap.hpp"
+#include "headers/sketch.hpp"
+#include "headers/half.hpp"
+#include "headers/vmath.hpp"
 #include "headers/datatype.hpp"
 #include "headers/error.hpp"
 
@@ -27,13 +42,30 @@ public:
 	float threshold; ///< Threshold
 	float g; ///< Gravity parameter
 	float power_eta; ///< Stepsize decay
+	uint32_t lazy; ///< Truncate each weight lazily when touched (0 or 1)
+	uint32_t incremental; ///< Slots moved per insertion when growing (0 to stop the world)
+	uint32_t cap; ///< Max number of weights in each space (0 for no limit)
+	uint32_t admit; ///< Times a new key should be seen to get a weight (0,1 for at once)
+	uint32_t admit_width; ///< Counters in a row of the sketch for admit
+	uint32_t alloc; ///< Allocation policy of the weight arrays, see big_alloc()
+	uint32_t dense; ///< Keys below it are indexed directly, see BigMap::set_dense()
+	float alpha; ///< Step size of FTRL-Proximal, see FTRL_Learner_T
+	float beta; ///< Smoothing of the step size of FTRL-Proximal
+	float l1; ///< L1 regularization of FTRL-Proximal
+	float l2; ///< L2 regularization of FTRL-Proximal
+	uint32_t adagrad; ///< Step size of each weight by AdaGrad (0 or 1), see LR_Learner_T::adagrad_rate()
+	uint32_t fast_math; ///< Fast exp and log in digest_batch() (0 or 1), see logistic_batch()
 
 	/**
 	 * Read from a file (with filename)
+	 *
+	 * Parameters after power_eta are optional.
 	 */
 	Parameter(const char * filename = NULL):
 		stepsize(0.1),K(100),threshold(1e3),g(1e-2),
-		power_eta(0.5)
+		power_eta(0.5),lazy(0),incremental(0),cap(0),
+		admit(0),admit_width(1<<16),alloc(ALLOC_PLAIN),dense(0),
+		alpha(0.1),beta(1),l1(1),l2(1),adagrad(0),fast_math(0)
 	{
 		if(!filename)
 			return;
@@ -46,6 +78,19 @@ public:
 		read_param(threshold,"%e");
 		read_param(g,"%e");
 		read_param(power_eta,"%e");
+		read_param(lazy,"%u");
+		read_param(incremental,"%u");
+		read_param(cap,"%u");
+		read_param(admit,"%u");
+		read_param(admit_width,"%u");
+		read_param(alloc,"%u");
+		read_param(dense,"%u");
+		read_param(alpha,"%e");
+		read_param(beta,"%e");
+		read_param(l1,"%e");
+		read_param(l2,"%e");
+		read_param(adagrad,"%u");
+		read_param(fast_math,"%u");
 		fclose(f);
 	}
 
@@ -60,10 +105,65 @@ public:
 		print_param(threshold,"%e");
 		print_param(g,"%e");
 		print_param(power_eta,"%e");
+		print_param(lazy,"%u");
+		print_param(incremental,"%u");
+		print_param(cap,"%u");
+		print_param(admit,"%u");
+		print_param(admit_width,"%u");
+		print_param(alloc,"%u");
+		print_param(dense,"%u");
+		print_param(alpha,"%e");
+		print_param(beta,"%e");
+		print_param(l1,"%e");
+		print_param(l2,"%e");
+		print_param(adagrad,"%u");
+		print_param(fast_math,"%u");
 	}
 
 };
 
+/**
+ * File format of the binary model snapshot, see LR_Learner_T::save_binary().
+ *
+ * A ModelHead, then a ModelSpace for each feature space, then the image of
+ * each map written by its dump(), starting at ModelSpace::offset.
+ * The images are aligned to MODEL_ALIGN, so the file can be mapped
+ * and the maps can use them in place.
+ */
+#define MODEL_MAGIC 0x444d524cu // "LRMD"
+#define MODEL_VERSION 5
+#define MODEL_ALIGN 4096
+#define MODEL_V1_ZERO 0 ///< v[1] of the saved weights is 0, see settle()
+#define MODEL_V1_SUM 1 ///< v[1] is the sum of the squared gradients, see LR_Learner_T::adagrad_rate()
+
+/**
+ * Head of a model snapshot.
+ */
+typedef struct
+{
+	uint32_t magic; ///< MODEL_MAGIC
+	uint32_t version; ///< MODEL_VERSION
+	uint32_t layout; ///< layout() of the map
+	uint32_t atom_size; ///< sizeof(Atom) of the map
+	uint32_t n_space; ///< number of feature space
+	uint32_t v1; ///< what v[1] holds, MODEL_V1_ZERO or MODEL_V1_SUM
+	double intercept; ///< intercept
+	double intercept_n; ///< sum of the squared gradients of the intercept, see FTRL_Learner_T
+} ModelHead;
+
+/**
+ * A feature space in a model snapshot.
+ */
+typedef struct
+{
+	uint64_t max_len; ///< max_size() of the map
+	uint64_t len; ///< size() of the map
+	uint64_t vacancy; ///< vacancies() of the map
+	uint64_t dense; ///< dense_size() of the map
+	uint64_t dense_len; ///< dense_limit() of the map
+	uint64_t offset; ///< where the image starts
+} ModelSpace;
+
 /**
  * Logistic Regression Learner
  *
@@ -71,14 +171,41 @@ public:
  *
  * The update rule is a truncated version of SGD, see
  * [TrSGD](http://jmlr.org/papers/volume10/langford09a/langford09a.pdf)
+ *
+ * MAP is where the weights of a feature space are stored,
+ * BigMap, SwissMap, SegMap or TieredMap of Atom<2,float>. With a narrower key,
+ * e.g. BigMap<2,float,uint32_t,uint32_t>, each weight takes 12 bytes
+ * instead of 16, see Atom::fold() for the price. The values may be
+ * fp16 or bf16 (see half.hpp), updated by stochastic rounding:
+ * BigMap<2,bf16,uint32_t,uint32_t> takes 8 bytes a weight.
+ *
+ * DERIVED is void, or a learner derived from it with other rules, as
+ * FTRL_Learner_T. The digest, predict and update paths here call
+ * weight(), step(), step_intercept(), step_scale() and truncate() of
+ * DERIVED instead of their own, see self(), so it overrides only them.
  */
-class LR_Learner
+template <class MAP = BigMap<2,float>, class DERIVED = void>
+class LR_Learner_T
 {
 	//FILE * fout;
 protected:
 	const uint32_t max_n_space; ///< max number of feature space
 	uint32_t n_space;///< number of feature space
 	double intercept;///< intercept
+	double intercept_n;///< sum of the squared gradients of the intercept, for par->adagrad and FTRL_Learner_T
+	uint32_t v1;///< what v[1] holds, MODEL_V1_ZERO or MODEL_V1_SUM
+	bool keep_sum;///< v[1] always holds the sum, as in FTRL_Learner_T
+	const Parameter * checked;///< par when check_param() was done
+	uint32_t inc_step;///< see BigMap::set_incremental()
+	uint32_t cap;///< see BigMap::set_cap()
+	uint32_t alloc;///< see BigMap::set_alloc()
+	uint32_t dense;///< see BigMap::set_dense()
+	uint32_t admit_k;///< see set_admission()
+	uint32_t admit_width;///< see set_admission()
+	std::vector<CountMin*> sketch;///< counts the keys not admitted yet, for each space
+	uint64_t n_rejected;///< number of updates dropped by admission
+	char * snapshot;///< mapped by load_binary(), used by the maps in place
+	uint64_t snapshot_len;///< length of snapshot
 public:
 	Parameter * par; ///< parameter for learning
 	uint64_t iter; ///< \f$ n \f$
@@ -86,18 +213,45 @@ public:
 	double sum_loss; ///< \f$ \sum_{i=1}^n W_i L(\hat{y}_i,y_i) \f$
 	double sum_wt; ///< \f$ \sum_{i=1}^n W_i \f$, \f$W_i\f$ is the weight for this sample
 
-	typedef BigMap<2,float> BIGMAP;
+	typedef MAP BIGMAP;
+	typedef typename MAP::ATOM ATOM;
+	/// the most derived learner, whose rules are used, see self()
+	typedef typename std::conditional<std::is_void<DERIVED>::value,
+			LR_Learner_T,DERIVED>::type LEARNER;
+	typedef typename ATOM::VALUE VALUE;
 	BIGMAP* m; ///< Stored model weights
+	uint32_t n_pending; ///< number of truncate() postponed by digest_shared()
+	/**
+	 * Sum of truncation of round 1..r in gravity[r]. (only for par->lazy)
+	 *
+	 * A weight touched at round r has ATOM::v[1] = r (the bits of uint32_t,
+	 * or of uint16_t for 16-bit values), it owes the truncation of
+	 * gravity.back()-gravity[r]. At most MAX_ROUND rounds are kept,
+	 * then settle() starts again from round 0.
+	 */
+	std::vector<double> gravity;
+	/// bytes of v[1] holding the round, see round_of()
+	static const uint32_t ROUND_BYTES = sizeof(VALUE)<4?sizeof(VALUE):4;
+	/// the last round that fits in ROUND_BYTES
+	static const uint32_t MAX_ROUND = ROUND_BYTES<4?(1u<<(8*ROUND_BYTES))-1:~0u;
+	std::vector<ATOM*> handle; ///< where the weights of the Sample are
+	std::vector<uint32_t> handle_gen; ///< BigMap::generation() of handle
+	std::vector<double> batch; ///< predictions, labels, weights, gradients and losses of digest_batch()
 
 	/**
 	 * Constructor
 	 *
 	 * @param _n_space number of feature space
 	 */
-	LR_Learner(uint32_t _n_space, uint32_t _max_n_space = 256):  
+	LR_Learner_T(uint32_t _n_space, uint32_t _max_n_space = 256):  
 		//fout(NULL),
-		max_n_space(_max_n_space), n_space(0), intercept(0),
-		par(NULL), iter(0), eta(1), sum_loss(0), sum_wt(0), m(NULL)
+		max_n_space(_max_n_space), n_space(0), intercept(0), intercept_n(0),
+		v1(MODEL_V1_ZERO), keep_sum(false), checked(NULL), inc_step(0), cap(0),
+		alloc(ALLOC_PLAIN), dense(0),
+		admit_k(0), admit_width(0), sketch(_max_n_space,NULL), n_rejected(0),
+		snapshot(NULL), snapshot_len(0),
+		par(NULL), iter(0), eta(1), sum_loss(0), sum_wt(0), m(NULL),
+		n_pending(0), gravity(1,0.0)
 	{
 		m = (BIGMAP*)malloc(max_n_space*sizeof(BIGMAP));
 		if(!m)
@@ -108,14 +262,19 @@ public:
 		//fout = fopen("LR_out.txt","a");
 	}
 
-	~LR_Learner()
+	~LR_Learner_T()
 	{
 		if(m==NULL)
 			return;
 		for(uint32_t i=0;i<n_space;i++)
+		{
 			m[i].~BIGMAP();
+			delete sketch[i];
+		}
 		free(m);
 		m = NULL;
+		if(snapshot!=NULL)
+			munmap(snapshot,snapshot_len);
 		//if(fout!=NULL)
 		//	fclose(fout);
 	}
@@ -127,7 +286,148 @@ public:
 	{
 		if(n_space==max_n_space)
 			error("Max size reached.\n");
-		m[n_space++].rehash(map_max_len);
+		m[n_space].set_alloc(alloc);
+		m[n_space].set_dense(dense);
+		m[n_space].rehash(map_max_len);
+		m[n_space].set_cap(cap);
+		if(admit_k>1)
+			sketch[n_space] = new CountMin(admit_width);
+		m[n_space++].set_incremental(inc_step);
+	}
+
+	/**
+	 * Learn with parameter p from now on.
+	 *
+	 * It is checked at once, see check_param(). (If par is assigned
+	 * instead, it is checked by the next digest().)
+	 */
+	void set_param(Parameter * p)
+	{
+		par = p;
+		check_param();
+	}
+
+	/**
+	 * Give a new key a weight only after it is seen k times. (0,1 to disable)
+	 *
+	 * The keys are counted by a CountMin of width for each space. Most keys in
+	 * the large spaces are seen once, and their weights would be truncated
+	 * to 0 soon, so it saves memory and rehashes. The updates before
+	 * a key is admitted are dropped, counted by rejections().
+	 */
+	void set_admission(uint32_t k, uint32_t width = 1<<16)
+	{
+		admit_k = k;
+		admit_width = width;
+		for(uint32_t i=0;i<n_space;i++)
+		{
+			delete sketch[i];
+			sketch[i] = (admit_k>1?new CountMin(admit_width):NULL);
+		}
+	}
+
+	/**
+	 * Number of updates dropped since the key was not admitted.
+	 */
+	uint64_t rejections() const { return n_rejected; }
+
+	/**
+	 * Return the intercept.
+	 */
+	double bias() const { return intercept; }
+
+	/**
+	 * Weight of an Atom, after its owed truncation in lazy mode.
+	 *
+	 * Without par, e.g. just after load(), it is v[0], since the saved
+	 * weights are settled.
+	 */
+	inline float weight(const ATOM& a) const
+	{
+		return par!=NULL and par->lazy?lazy_weight(a):(float)a.v[0];
+	}
+
+	/**
+	 * Whether weight() can be taken now. (always, see weight())
+	 */
+	bool weighable() const { return true; }
+
+	/**
+	 * Number of rehash of all the spaces, see BigMap::rehashes().
+	 */
+	uint64_t rehashes() const
+	{
+		uint64_t n = 0;
+		for(uint32_t i=0;i<n_space;i++)
+			n += m[i].rehashes();
+		return n;
+	}
+
+	/**
+	 * Let every BigMap grow incrementally, see BigMap::set_incremental().
+	 *
+	 * The feature spaces added later also follow it.
+	 */
+	void set_incremental(uint32_t step)
+	{
+		inc_step = step;
+		for(uint32_t i=0;i<n_space;i++)
+			m[i].set_incremental(step);
+	}
+
+	/**
+	 * Keep at most _cap weights in every BigMap, see BigMap::set_cap().
+	 *
+	 * The feature spaces added later also follow it.
+	 * Evicting a weight is like truncating it to 0 early, so a cap less
+	 * than the number of useful weights in a space hurts the loss.
+	 */
+	void set_cap(uint32_t _cap)
+	{
+		cap = _cap;
+		for(uint32_t i=0;i<n_space;i++)
+			m[i].set_cap(cap);
+	}
+
+	/**
+	 * Allocate the weight arrays by policy, see big_alloc().
+	 *
+	 * The feature spaces added later also follow it. It takes effect
+	 * when a map is rehashed, e.g. ALLOC_THP for huge pages makes
+	 * the random lookups of a big model miss the TLB less.
+	 */
+	void set_alloc(uint32_t policy)
+	{
+		alloc = policy;
+		for(uint32_t i=0;i<n_space;i++)
+			m[i].set_alloc(alloc);
+	}
+
+	/**
+	 * Index the keys below n of every space directly, see BigMap::set_dense().
+	 *
+	 * The feature spaces added later also follow it. A space of small
+	 * integer keys (hours, regions, ad sizes) gets an array of n weights
+	 * at its first such key and looks them up by a single index, while
+	 * a space of hashed keys never gets one. So it needs no list of spaces,
+	 * and a space may mix both kinds of keys.
+	 */
+	void set_dense(uint32_t n)
+	{
+		dense = n;
+		for(uint32_t i=0;i<n_space;i++)
+			m[i].set_dense(dense);
+	}
+
+	/**
+	 * Number of weights evicted from all the spaces.
+	 */
+	uint64_t evictions() const
+	{
+		uint64_t n = 0;
+		for(uint32_t i=0;i<n_space;i++)
+			n += m[i].evictions();
+		return n;
 	}
 
 	/**
@@ -137,9 +437,9 @@ public:
 	{
 		if(n_space==0)
 			return;
-		m[n_space].~BIGMAP();
-		// memset(m+n_space,0,sizeof(BigMap)); // This is for safe, not necessary.
-		n_space--;
+		m[--n_space].dtor();
+		delete sketch[n_space];
+		sketch[n_space] = NULL;
 	}
 
 	/**
@@ -164,19 +464,138 @@ public:
 	 */
 	double digest(const Sample& s,bool _update = true)
 	{
-		double f = predict(s);
-		sum_loss += s.wt*Loss(s.y,f,s);
-		sum_wt += s.wt;
+		if(par!=checked)
+			check_param();
 		if(not _update)
+		{
+			double f = predict(s);
+			sum_loss += s.wt*Loss(s.y,f,s);
+			sum_wt += s.wt;
 			return f;
+		}
+		double f = resolve(s);
+		sum_loss += s.wt*Loss(s.y,f,s);
+		sum_wt += s.wt;
 		iter++;
 		eta = pow(1.0/iter,par->power_eta);
 		update(s,f,s.wt);
 		if(iter % par->K == 0)
-			truncate();
+			self().truncate();
+		return f;
+	}
+
+	/**
+	 * Digest n Sample as a mini-batch.
+	 *
+	 * Works like digest() on each of them, except that
+	 * 1. all the predictions are made before any update, so a Sample
+	 *    does not see the updates of those before it in the batch,
+	 * 2. the losses and gradients are computed at once by
+	 *    logistic_batch(), fast if par->fast_math,
+	 * 3. \f$\eta\f$ is computed once, for the last Sample, and
+	 *    truncate() is called after the updates, once for each
+	 *    multiple of par->K reached in the batch.
+	 *
+	 * Return the sum of \f$ W_i L(\hat{y}_i,y_i) \f$ of the batch.
+	 *
+	 * @param f if not NULL, the predictions are put in it
+	 */
+	double digest_batch(const Sample* s, uint32_t n, double* f = NULL)
+	{
+		if(par!=checked)
+			check_param();
+		if(n==0)
+			return 0;
+		if(batch.size()<5*n)
+			batch.resize(5*n);
+		double* bf = &batch[0];
+		double* by = bf+n;
+		double* bw = by+n;
+		double* bg = bw+n;
+		double* bl = bg+n;
+		for(uint32_t i=0,h=0;i<n;h+=s[i].len,i++)
+		{
+			bf[i] = resolve(s[i],h);
+			by[i] = s[i].y;
+			bw[i] = s[i].wt;
+		}
+		logistic_batch(bf,by,bw,bg,bl,n,par->fast_math);
+		double loss = 0;
+		for(uint32_t i=0;i<n;i++)
+		{
+			loss += bw[i]*bl[i];
+			sum_wt += bw[i];
+		}
+		sum_loss += loss;
+		const uint64_t start = iter;
+		iter += n;
+		eta = pow(1.0/iter,par->power_eta);
+		for(uint32_t i=0,h=0;i<n;h+=s[i].len,i++)
+			descend(s[i],bg[i],h);
+		for(uint64_t k=iter/par->K-start/par->K;k>0;k--)
+			self().truncate();
+		if(f!=NULL)
+			memcpy(f,bf,n*sizeof(double));
+		return loss;
+	}
+
+	/**
+	 * Digest a Sample, while other threads may do the same. (Hogwild!)
+	 *
+	 * Works like digest(), except that
+	 * 1. weights are read and written without any lock, see update_shared(),
+	 * 2. the loss is returned in loss and not added to sum_loss,
+	 * 3. truncate() and rehash are postponed. When they are due,
+	 *    sync is set to true, and maintain() should be called
+	 *    as soon as no thread is digesting.
+	 *
+	 * See learner/hogwild.hpp for the threads that call it, after
+	 * set_param(), so the check here only reads.
+	 */
+	double digest_shared(const Sample& s, double& loss, bool& sync)
+	{
+		if(par!=checked)
+			check_param();
+		double f = predict(s);
+		loss = Loss(s.y,f,s);
+		const uint64_t i = __sync_add_and_fetch(&iter,1);
+		if(not update_shared(s,f,s.wt,pow(1.0/i,par->power_eta)))
+			sync = true;
+		if(i % par->K == 0)
+		{
+			__sync_fetch_and_add(&n_pending,1);
+			sync = true;
+		}
 		return f;
 	}
 
+	/**
+	 * Do what digest_shared() has postponed.
+	 *
+	 * Rehash the overfull maps and call the pending truncate().
+	 * No thread should be in digest_shared() meanwhile.
+	 *
+	 * A map growing incrementally is moved at once here,
+	 * and a full map evicts 1/16 of its cap,
+	 * since BigMap::insert_shared() does not work on them.
+	 */
+	void maintain()
+	{
+		eta = pow(1.0/iter,par->power_eta);
+		for(;n_pending>0;n_pending--)
+			self().truncate();
+		for(uint32_t i=0;i<n_space;i++)
+		{
+			if(par->lazy and m[i].overfull())
+				settle(i);
+			else
+				m[i].rehash_if_overfull();
+			m[i].finish_moving();
+			if(m[i].full())
+				m[i].evict(cap/16+1);
+		}
+	}
+
 	/**
 	 * Output statistics.
 	 */
@@ -185,14 +604,19 @@ public:
 		static bool print_head = true;
 		if(print_head)
 		{
-			printf("      iter   size   weight     step     loss  \n");
+			printf("      iter   size   weight     step     loss  %s%s\n",
+					cap>0?" evicted ":"",admit_k>1?" rejected":"");
 			print_head = false;
 		}
-		uint32_t sum_size = 0;
+		uint64_t sum_size = 0;
 		for(uint32_t i=0;i<n_space;i++)
 			sum_size += m[i].size();
-		printf("%10lu %6u %4.2le %4.2le %8.6lf ",
+		printf("%10lu %6lu %4.2le %4.2le %8.6lf ",
 				iter,sum_size,sum_wt,eta*par->stepsize,sum_loss/sum_wt);
+		if(cap>0)
+			printf("%8lu ",evictions());
+		if(admit_k>1)
+			printf("%8lu ",rejections());
 		if(!omit_newline)
 			printf("\n");
 		//fprintf(fout,"%10lu\t%6u\t%8le\t%8le\t%8.6lf\n",
@@ -202,17 +626,58 @@ public:
 	}
 
 	/**
-	 * Save the model to a file.
+	 * Quantize the weights to int8 for serving, return the scale of each space.
+	 *
+	 * A weight w of space i becomes scale[i]*to_int8(w,scale[i]), with
+	 * scale[i] = int8_scale() of the largest |w| of space i, and it is
+	 * erased if that is 0. Then the model predicts as it would be
+	 * served with an int8 and a scale, so its loss tells the price.
+	 * In lazy mode, settle() is called first.
+	 */
+	std::vector<float> quantize()
+	{
+		settle();
+		std::vector<float> scale(n_space);
+		for(uint32_t i=0;i<n_space;i++)
+		{
+			float max_abs = 0;
+			for(auto t=m[i].begin();t!=m[i].end();t=m[i].next(t))
+				if(fabsf(t->v[0])>max_abs)
+					max_abs = fabsf(t->v[0]);
+			scale[i] = int8_scale(max_abs);
+			for(auto t=m[i].begin();t!=m[i].end();)
+			{
+				const int8_t q = to_int8(t->v[0],scale[i]);
+				if(q==0)
+				{
+					t = m[i].erase(t);
+					continue;
+				}
+				t->v[0] = scale[i]*q;
+				t = m[i].next(t);
+			}
+		}
+		return scale;
+	}
+
+	/**
+	 * Save the model to a text file.
+	 *
+	 * It is slow and large for a big model, use save_binary() for
+	 * a snapshot to load again, and this one to export.
+	 * In lazy mode, settle() is called first.
 	 */
-	uint32_t save(const char * filename) const
+	uint64_t save(const char * filename)
 	{
+		settle();
 		info("Save to %s\n",filename);
-		uint32_t saved = 0;
+		uint64_t saved = 0;
 		FILE * fo = fopen(filename,"w");
 		if(!fo)
 			error("Failed to open %s for writing.\n",filename);
 		fprintf(fo,"n_space: %u\n",n_space);
 		fprintf(fo,"intercept: %12le\n",intercept);
+		fprintf(fo,"v1: %u\n",v1);
 		for(uint32_t i=0;i<n_space;i++)
 		{
 			fprintf(fo,"=== Space %u ===\n",i);
@@ -223,38 +688,175 @@ public:
 		return saved;
 	}
 
+	/**
+	 * Save the model to a binary snapshot, see ModelHead.
+	 *
+	 * It is written to filename.tmp and then renamed, so a snapshot mapped
+	 * by load_binary() stays valid while being replaced.
+	 * In lazy mode, settle() is called first.
+	 */
+	uint64_t save_binary(const char * filename)
+	{
+		settle();
+		info("Save to %s\n",filename);
+		std::vector<char> tmp(strlen(filename)+5);
+		sprintf(&tmp[0],"%s.tmp",filename);
+		FILE * fo = fopen(&tmp[0],"wb");
+		if(!fo)
+			error("Failed to open %s for writing.\n",&tmp[0]);
+		ModelHead head = {MODEL_MAGIC,MODEL_VERSION,BIGMAP::layout(),
+			sizeof(ATOM),n_space,v1,intercept,intercept_n};
+		std::vector<ModelSpace> space(n_space);
+		uint64_t offset = sizeof(head) + n_space*sizeof(ModelSpace);
+		uint64_t saved = 0;
+		for(uint32_t i=0;i<n_space;i++)
+		{
+			m[i].finish_moving();
+			offset = (offset+MODEL_ALIGN-1)/MODEL_ALIGN*MODEL_ALIGN;
+			space[i] = {m[i].max_size(),m[i].size(),m[i].vacancies(),
+				m[i].dense_size(),m[i].dense_limit(),offset};
+			offset += BIGMAP::image_size(m[i].max_size(),m[i].dense_size());
+			saved += m[i].size();
+		}
+		qassert(1==fwrite(&head,sizeof(head),1,fo));
+		if(n_space>0)
+			qassert(n_space==fwrite(&space[0],sizeof(ModelSpace),n_space,fo));
+		for(uint32_t i=0;i<n_space;i++)
+		{
+			qassert(0==fseek(fo,space[i].offset,SEEK_SET));
+			m[i].dump(fo);
+		}
+		fclose(fo);
+		if(0!=rename(&tmp[0],filename))
+			error("Failed to rename %s to %s.\n",&tmp[0],filename);
+		return saved;
+	}
+
+	/**
+	 * Load the model from a binary snapshot, see ModelHead.
+	 *
+	 * The file is mapped privately and the maps use it in place,
+	 * so it takes no time to load, and the weights are read from the disk
+	 * when they are used. The changes are not written back to the file.
+	 */
+	uint64_t load_binary(const char * filename)
+	{
+		int fd = open(filename,O_RDONLY);
+		if(fd<0)
+		{
+			warning("Failed to load from %s.\n",filename);
+			return 0;
+		}
+		info("Load from %s\n",filename);
+		const uint64_t len = lseek(fd,0,SEEK_END);
+		if(len<sizeof(ModelHead))
+			error("%s is not a model snapshot.\n",filename);
+		char * mem = (char*)mmap(NULL,len,PROT_READ|PROT_WRITE,MAP_PRIVATE,fd,0);
+		close(fd);
+		if(mem==MAP_FAILED)
+			error("Failed to mmap %s.\n",filename);
+		const ModelHead* head = (const ModelHead*)mem;
+		if(head->magic!=MODEL_MAGIC or head->version!=MODEL_VERSION)
+			error("%s is not a model snapshot of version %u.\n",
+					filename,MODEL_VERSION);
+		if(head->layout!=BIGMAP::layout() or head->atom_size!=sizeof(ATOM))
+			error("%s has map layout %u of %u bytes Atom, expect %u of %lu.\n",
+					filename,head->layout,head->atom_size,
+					BIGMAP::layout(),sizeof(ATOM));
+		if(head->n_space>max_n_space)
+			error("%s has %u spaces, more than %u.\n",
+					filename,head->n_space,max_n_space);
+		const ModelSpace* space = (const ModelSpace*)(head+1);
+		qassert(sizeof(ModelHead)+head->n_space*sizeof(ModelSpace)<=len);
+		const uint32_t old_n_space = n_space;
+		while(n_space>0)
+			decr();
+		gravity.assign(1,0.0); // the loaded weights owe nothing, see settle()
+		if(snapshot!=NULL)
+			munmap(snapshot,snapshot_len);
+		snapshot = mem;
+		snapshot_len = len;
+		if(old_n_space!=head->n_space)
+			warning("n_space: old: %u new: %u, choose %u\n",
+					old_n_space,head->n_space,
+					(old_n_space>head->n_space?old_n_space:head->n_space));
+		intercept = head->intercept;
+		intercept_n = head->intercept_n;
+		v1 = head->v1;
+		uint64_t loaded = 0;
+		for(uint32_t i=0;i<head->n_space;i++)
+		{
+			qassert(space[i].offset%MODEL_ALIGN==0);
+			qassert(space[i].offset+BIGMAP::image_size(space[i].max_len,space[i].dense)<=len);
+			m[n_space].set_dense(dense);
+			m[n_space].link(mem+space[i].offset,space[i].max_len,
+					space[i].len,space[i].vacancy,space[i].dense,space[i].dense_len);
+			m[n_space].set_incremental(inc_step);
+			if(admit_k>1)
+				sketch[n_space] = new CountMin(admit_width);
+			n_space++;
+			loaded += space[i].len;
+		}
+		while(n_space<old_n_space)
+			incr();
+		info("%lu data mapped.\n",loaded);
+		checked = NULL;
+		if(par!=NULL)
+			check_param();
+		return loaded;
+	}
+
 	/**
 	 * Load the model from a file
+	 *
+	 * A binary snapshot is loaded by load_binary(), else it should be
+	 * written by save().
 	 */
-	uint32_t load(const char * filename)
+	uint64_t load(const char * filename)
 	{
-		uint32_t loaded = 0;
+		uint64_t loaded = 0;
 		FILE* fi = fopen(filename,"r");
 		if(!fi)
 		{
 			warning("Failed to load from %s.\n",filename);
 			return 0;
 		}
+		uint32_t magic = 0;
+		if(1==fread(&magic,sizeof(magic),1,fi) and magic==MODEL_MAGIC)
+		{
+			fclose(fi);
+			return load_binary(filename);
+		}
+		rewind(fi);
 		info("Load from %s\n",filename);
 		uint32_t new_n_space,old_n_space = n_space;
 		qassert(1==fscanf(fi,"n_space: %u\n",&new_n_space));
 		while(n_space>0)
 			decr();
+		gravity.assign(1,0.0); // the loaded weights owe nothing, see settle()
 		if(old_n_space!=new_n_space)
 			warning("n_space: old: %u new: %u, choose %u\n",
 					old_n_space,new_n_space,
 					(old_n_space>new_n_space?old_n_space:new_n_space));
 		qassert(1==fscanf(fi,"intercept: %le\n",&intercept));
+		if(1!=fscanf(fi,"v1: %u\n",&v1)) // not in older files
+			v1 = MODEL_V1_ZERO;
 		for(uint32_t i=0;i<new_n_space;i++)
 		{
 			uint32_t space;
 			qassert(1==fscanf(fi,"=== Space %u ===\n",&space));
 			qassert(space==i and i==n_space);
+			if(admit_k>1)
+				sketch[n_space] = new CountMin(admit_width);
 			loaded += m[n_space++].load(fi);
 		}
+		fclose(fi);
 		while(n_space<old_n_space)
 			incr();
-		info("%u data loaded.\n",loaded);
+		info("%lu data loaded.\n",loaded);
+		checked = NULL;
+		if(par!=NULL)
+			check_param();
 		return loaded;
 	}
 
@@ -273,14 +875,78 @@ protected:
 	inline double predict(const Sample& s) const
 	{
 		double f = intercept;
+		prefetch(s);
 		for(auto p=s.x;p<s.x+s.len;p++)
+		{
+			if(p-s.x+PREFETCH_DISTANCE<s.len)
+				prefetch(p[PREFETCH_DISTANCE]);
 			if(p->space < n_space)
-				f += m[p->space].get(p->key).v[0]*p->value;
+				f += self().weight(m[p->space].get(p->key))*p->value;
+		}
 		if(f!=f)
 			debug("predict() yields NaN.\n");
 		return f;
 	}
 
+	/**
+	 * Prefetch the weight of Feature p, see BigMap::prefetch().
+	 */
+	inline void prefetch(const Feature& p) const
+	{
+		if(p.space < n_space)
+			m[p.space].prefetch(p.key);
+	}
+
+	/**
+	 * Prefetch the weights of the first PREFETCH_DISTANCE Feature of s.
+	 *
+	 * Then the loops over s prefetch PREFETCH_DISTANCE Feature ahead,
+	 * so the cache misses of the lookup in different maps overlap.
+	 * (See BigMap::find_batch() for a batch in the same map.)
+	 */
+	inline void prefetch(const Sample& s) const
+	{
+		for(uint32_t j=0;j<s.len and j<PREFETCH_DISTANCE;j++)
+			prefetch(s.x[j]);
+	}
+
+	/**
+	 * Make prediction on Sample s, and keep where its weights are.
+	 *
+	 * The same as predict(), but the ATOM* of each Feature (or NULL if not
+	 * found) is kept in handle, so that update() needs not find it again.
+	 *
+	 * @param h where the handle of s start, see digest_batch()
+	 */
+	inline double resolve(const Sample& s, uint32_t h = 0)
+	{
+		if(handle.size()<h+s.len)
+		{
+			handle.resize(h+s.len);
+			handle_gen.resize(h+s.len);
+		}
+		double f = intercept;
+		prefetch(s);
+		for(uint32_t j=0;j<s.len;j++)
+		{
+			if(j+PREFETCH_DISTANCE<s.len)
+				prefetch(s.x[j+PREFETCH_DISTANCE]);
+			const Feature& p = s.x[j];
+			if(p.space >= n_space)
+				continue;
+			ATOM* a = m[p.space].find(p.key);
+			if(a==m[p.space].end())
+				a = NULL;
+			handle[h+j] = a;
+			handle_gen[h+j] = m[p.space].generation();
+			if(a!=NULL)
+				f += self().weight(*a)*p.value;
+		}
+		if(f!=f)
+			debug("resolve() yields NaN.\n");
+		return f;
+	}
+
 	/**
 	 * Update model
 	 *
@@ -297,19 +963,182 @@ protected:
 	 *
 	 * @param f prediction
 	 * @param wt \f$W_i\f$, weight for this sample
+	 *
+	 * It uses the handle kept by resolve(), unless the map has changed
+	 * its generation since then. A weight not found is inserted only if
+	 * its gradient is not zero.
+	 *
+	 * With par->adagrad, \f$s\eta\f$ is adagrad_rate() of each weight.
 	 */
 	inline void update(const Sample& s, double f, double wt)
 	{
 		const double y = s.y;
 		const double p = 1/(1+exp(-y*f));
-		const double d = wt*par->stepsize*eta*(p-1)*y;
-		intercept -= d;
+		descend(s,wt*(p-1)*y);
+	}
+
+	/**
+	 * Move the weights of Sample s by g, the gradient of the loss on f,
+	 * see update().
+	 *
+	 * @param h where the handle of s start, see resolve()
+	 */
+	inline void descend(const Sample& s, double g, uint32_t h = 0)
+	{
+		const double d = self().step_scale(eta)*g;
+		self().step_intercept(d);
+		for(uint32_t j=0;j<s.len;j++)
+		{
+			const Feature& t = s.x[j];
+			if(t.space >= n_space)
+				continue;
+			BIGMAP& mm = m[t.space];
+			ATOM* a = handle[h+j];
+			if(handle_gen[h+j]!=mm.generation())
+			{
+				a = mm.find(t.key);
+				if(a==mm.end())
+					a = NULL;
+			}
+			const double g = d*t.value;
+			if(a==NULL)
+			{
+				if(g==0)
+					continue;
+				if(sketch[t.space]!=NULL and
+						sketch[t.space]->add(t.key)<admit_k)
+				{
+					n_rejected++;
+					continue;
+				}
+				if(par->lazy and mm.overfull())
+					settle(t.space);
+				a = &mm[t.key];
+			}
+			self().step(*a,g);
+		}
+	}
+
+	/**
+	 * Update model, while other threads may do the same.
+	 *
+	 * The same rule as update(), but with eta of this thread.
+	 * New keys are inserted by BigMap::insert_shared(), and the updates of
+	 * the same weight from different threads may overwrite each other.
+	 * Return false if some update was dropped since a map is full,
+	 * or if some map should be rehashed soon.
+	 *
+	 * @param e \f$\eta\f$ for this Sample
+	 */
+	inline bool update_shared(const Sample& s, double f, double wt, double e)
+	{
+		const double y = s.y;
+		const double p = 1/(1+exp(-y*f));
+		const double d = wt*self().step_scale(e)*(p-1)*y;
+		bool ok = true;
+		self().step_intercept(d);
+		prefetch(s);
 		for(auto t=s.x;t<s.x+s.len;t++)
 		{
+			if(t-s.x+PREFETCH_DISTANCE<s.len)
+				prefetch(t[PREFETCH_DISTANCE]);
 			if(t->space >= n_space)
 				continue;
-			m[t->space][t->key].v[0] -= d*t->value;
+			const BIGMAP& mm = m[t->space]; // the const find() moves nothing
+			if(sketch[t->space]!=NULL and
+					mm.find(t->key)==mm.end() and
+					sketch[t->space]->add(t->key)<admit_k)
+			{
+				__sync_fetch_and_add(&n_rejected,1);
+				continue;
+			}
+			ATOM* a = m[t->space].insert_shared(t->key);
+			if(a==NULL or m[t->space].overfull())
+				ok = false;
+			if(a==NULL)
+				continue;
+			self().step(*a,d*t->value);
 		}
+		return ok;
+	}
+
+	/**
+	 * This learner as LEARNER, whose rules are used.
+	 */
+	inline LEARNER& self() { return static_cast<LEARNER&>(*this); }
+	inline const LEARNER& self() const { return static_cast<const LEARNER&>(*this); }
+
+	/**
+	 * Factor of the gradient of a Sample, for \f$\eta\f$ of e.
+	 *
+	 * \f$ s\eta \f$, or 1 with par->adagrad, see update().
+	 */
+	inline double step_scale(double e) const
+	{
+		return par->adagrad?1:par->stepsize*e;
+	}
+
+	/**
+	 * Move the intercept by d, the gradient times step_scale().
+	 */
+	inline void step_intercept(double d)
+	{
+		if(par->adagrad)
+			adagrad_intercept(d);
+		else
+			intercept -= d;
+	}
+
+	/**
+	 * Move an Atom by g, its gradient times step_scale().
+	 *
+	 * In lazy mode, its owed truncation is paid first, see touch().
+	 */
+	inline void step(ATOM& a, double g) const
+	{
+		if(par->lazy)
+			touch(a);
+		if(par->adagrad)
+			adagrad_step(a,g);
+		else
+			store(a.v[0],a.v[0]-g);
+	}
+
+	/**
+	 * Step size of an Atom by AdaGrad. (par->adagrad)
+	 *
+	 * \f$ s/\sqrt{n} \f$, in which \f$n\f$ is the sum of the squared
+	 * gradients of this weight, kept in ATOM::v[1]. So a rare weight
+	 * moves fast and a common one slowly, while \f$\eta\f$ is not used.
+	 * With fp16 values, \f$n\f$ stops at 65504, use float or bf16 for
+	 * samples of large weight.
+	 */
+	inline double adagrad_rate(const ATOM& a) const
+	{
+		const double n = a.v[1];
+		return n>0?par->stepsize/sqrt(n):par->stepsize;
+	}
+
+	/**
+	 * Move an Atom by gradient g, by AdaGrad. (par->adagrad)
+	 *
+	 * Lazy mode keeps the round in v[1], so they do not work together,
+	 * see check_param().
+	 */
+	inline void adagrad_step(ATOM& a, double g) const
+	{
+		store(a.v[1],a.v[1]+g*g);
+		store(a.v[0],a.v[0]-adagrad_rate(a)*g);
+	}
+
+	/**
+	 * Move the intercept by gradient g, by AdaGrad. (par->adagrad)
+	 */
+	inline void adagrad_intercept(double g)
+	{
+		intercept_n += g*g;
+		if(intercept_n>0)
+			intercept -= par->stepsize*g/sqrt(intercept_n);
 	}
 
 	/**
@@ -326,16 +1155,28 @@ protected:
 	 * 		\end{array}\right.
 	 * \f]
 	 * \f$\theta\f$ is par->threshold, \f$\alpha\f$ is \f$\eta\f$*par->g*par->K
+	 * (with par->adagrad, adagrad_rate()*par->g*par->K for each weight)
+	 *
+	 * In lazy mode, only \f$\alpha\f$ is recorded in gravity, and
+	 * each weight is truncated when it is touched next time, see touch().
 	 */
 	inline void truncate()
 	{
 		const double trunc = par->K * par->stepsize * eta * par->g;
+		if(par->lazy)
+		{
+			if(gravity.size()>MAX_ROUND) // the next round would not fit in v[1]
+				settle();
+			gravity.push_back(gravity.back()+trunc);
+			return;
+		}
 		for(uint32_t i=0;i<n_space;i++)
 			for(auto t=m[i].begin();t!=m[i].end();)
 			{// Be cautious when deleting while traversing
+				const double tr = par->adagrad?par->K*par->g*adagrad_rate(*t):trunc;
 				if(0 <= t->v[0] and t->v[0] < par->threshold)
 				{
-					t->v[0] -= trunc;
+					store(t->v[0],t->v[0]-tr);
 					if(t->v[0] <= 0)
 					{
 						t = m[i].erase(t); // erase() return next()
@@ -344,7 +1185,7 @@ protected:
 				}
 				else if(0 >= t->v[0] and t->v[0] > -par->threshold)
 				{
-					t->v[0] += trunc;
+					store(t->v[0],t->v[0]+tr);
 					if(t->v[0] >= 0)
 					{
 						t = m[i].erase(t);
@@ -355,6 +1196,134 @@ protected:
 			}
 	}
 
+	/**
+	 * Weight of an Atom after its owed truncation. (lazy mode)
+	 *
+	 * Applying the sum of \f$\alpha\f$ of the rounds missed at once
+	 * gives the same result as truncate() once for each round,
+	 * since T() only moves a weight toward 0 and never across it,
+	 * so a weight inside \f$(-\theta,\theta)\f$ stays inside.
+	 * 0 means the Atom would have been erased.
+	 */
+	inline float lazy_weight(const ATOM& a) const
+	{
+		const double trunc = gravity.back() - gravity[round_of(a)];
+		float w = a.v[0];
+		if(trunc==0)
+			return w;
+		if(0 <= w and w < par->threshold)
+		{
+			w -= trunc;
+			if(w <= 0)
+				w = 0;
+		}
+		else if(0 >= w and w > -par->threshold)
+		{
+			w += trunc;
+			if(w >= 0)
+				w = 0;
+		}
+		return w;
+	}
+
+	/**
+	 * Pay the owed truncation of an Atom. (lazy mode)
+	 */
+	inline void touch(ATOM& a) const
+	{
+		store(a.v[0],lazy_weight(a));
+		set_round(a,gravity.size()-1);
+	}
+
+	/**
+	 * Check par against the model, once for each par.
+	 *
+	 * Lazy mode keeps the round in v[1], while par->adagrad and
+	 * FTRL_Learner_T keep the sum of the squared gradients (MODEL_V1_SUM),
+	 * so lazy mode does not work with them. A model of MODEL_V1_SUM
+	 * learned in lazy mode has its v[1] reset to 0, thus the sums lost.
+	 */
+	void check_param()
+	{
+		if(par->lazy and (par->adagrad or keep_sum))
+			error("v[1] holds the round in lazy mode, set lazy or adagrad to 0,"
+					" and lazy to 0 for FTRL_Learner_T.\n");
+		if(keep_sum and par->adagrad)
+			error("FTRL_Learner_T keeps n in v[1], set adagrad to 0.\n");
+		if(par->lazy and v1==MODEL_V1_SUM)
+		{
+			warning("v[1] of the model holds sums of squared gradients, reset to 0 for lazy mode.\n");
+			for(uint32_t i=0;i<n_space;i++)
+				for(auto t=m[i].begin();t!=m[i].end();t=m[i].next(t))
+					t->v[1] = 0;
+			gravity.assign(1,0.0);
+			v1 = MODEL_V1_ZERO;
+		}
+		if((par->adagrad or keep_sum) and v1!=MODEL_V1_SUM)
+		{
+			settle(); // no round left in v[1]
+			v1 = MODEL_V1_SUM;
+		}
+		checked = par;
+	}
+
+	/**
+	 * Round of the last touch of an Atom, in the bits of v[1]. (lazy mode)
+	 */
+	static inline uint32_t round_of(const ATOM& a)
+	{
+		uint32_t r = 0;
+		memcpy(&r,&a.v[1],ROUND_BYTES);
+		return r;
+	}
+
+	static inline void set_round(ATOM& a, uint32_t r)
+	{
+		memcpy(&a.v[1],&r,ROUND_BYTES);
+	}
+
+	/**
+	 * Pay the owed truncation in space i and erase the zero weights,
+	 * then rehash it if still overfull. (lazy mode)
+	 *
+	 * In lazy mode, the erased weights stay in the maps until this is done.
+	 * So it is done when a map is going to be rehashed, to keep the map
+	 * from growing for them, and it costs no more than the rehash itself.
+	 */
+	void settle(uint32_t i)
+	{
+		const uint32_t r = gravity.size()-1;
+		for(auto t=m[i].begin();t!=m[i].end();)
+		{
+			store(t->v[0],lazy_weight(*t));
+			set_round(*t,r);
+			if(t->v[0] == 0)
+				t = m[i].erase(t);
+			else
+				t = m[i].next(t);
+		}
+		m[i].rehash_if_overfull();
+	}
+
+	/**
+	 * Pay all the owed truncation and erase the zero weights. (lazy mode)
+	 *
+	 * After it every v[1] is 0 and gravity starts again,
+	 * so the saved model is the same as that of the eager truncate().
+	 */
+	void settle()
+	{
+		if(gravity.size()==1)
+			return;
+		for(uint32_t i=0;i<n_space;i++)
+		{
+			settle(i);
+			for(auto t=m[i].begin();t!=m[i].end();t=m[i].next(t))
+				set_round(*t,0);
+		}
+		gravity.assign(1,0.0);
+	}
+
 	/**
 	 * gradient of Loss.
 	 *
@@ -391,3 +1360,5 @@ protected:
 	}
 };
 
+typedef LR_Learner_T<> LR_Learner;
+
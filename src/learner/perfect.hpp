@@ -0,0 +1,391 @@
+/**
+ * @file perfect.hpp
+ * @brief Read-only model for serving, indexed by a minimal perfect hash.
+ * @author linus
+ * @version 1.0
+ * @date 2013-10-03
+ */
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <utility>
+extern "C" {
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+}
+
+#include "headers/hash.hpp"
+#include "headers/mphf.hpp"
+#include "headers/half.hpp"
+#include "headers/alloc.hpp"
+#include "headers/datatype.hpp"
+#include "headers/error.hpp"
+#include "learner/frozen.hpp"
+
+/**
+ * File format of a perfect model, see Perfect_T::save().
+ *
+ * A PerfectHead, the scale of each space, then the pilots, the remaps
+ * and the slots, starting at PerfectHead::data.
+ */
+#define PERFECT_MAGIC 0x4850524cu // "LRPH"
+#define PERFECT_VERSION 1
+#define PERFECT_ALIGN 4096
+#define PERFECT_BATCH 16 ///< Feature hashed and prefetched at once by Perfect_T::predict()
+
+/**
+ * Head of a perfect model.
+ */
+typedef struct
+{
+	uint32_t magic; ///< PERFECT_MAGIC
+	uint32_t version; ///< PERFECT_VERSION
+	uint32_t value_size; ///< sizeof() the value
+	uint32_t print_size; ///< sizeof() the fingerprint
+	uint32_t key_bits; ///< Atom::KEY_BITS of the learner
+	uint32_t n_space; ///< number of feature space
+	double intercept; ///< intercept
+	uint64_t n; ///< number of keys, MPHF::size()
+	uint64_t n_bucket; ///< MPHF::buckets()
+	uint64_t m; ///< MPHF::positions()
+	uint64_t pilot; ///< where the pilots start in the data
+	uint64_t remap; ///< where the remaps start in the data
+	uint64_t slot; ///< where the slots start in the data
+	uint64_t data; ///< where the data starts
+	uint64_t data_len; ///< length of the data
+} PerfectHead;
+
+/**
+ * Read-only logistic regression model, indexed by a minimal perfect hash.
+ *
+ * Once a model is trained (and truncated), its keys are fixed, so
+ * build() puts the nonzero weights of all spaces in an array of n
+ * slots, the MPHF of their keys giving the slot of each. A slot has a
+ * fingerprint of type F and a value of type V (as Frozen_T, int8_t
+ * values have a scale of each space), nothing else: with float and
+ * uint32_t, 8 bytes for a weight, and the MPHF adds about 4 bits.
+ *
+ * A key is fmix() of the folded key xor'ed with the salt of the space,
+ * as in a merged Frozen_T; its low bits are the fingerprint. A key not
+ * in the model goes to some slot too, whose fingerprint differs but one
+ * time in 2**(8*sizeof(F)), when the weight of that slot is taken.
+ * So a miss costs as much as a hit: two dependent reads, the pilot of
+ * the bucket, then the slot, with a remap between for about 2% of the
+ * keys. The pilots are about 0.4 bytes a key, so they are in cache for
+ * a small model only. predict() prefetches the pilots of a batch of
+ * Feature, then their slots, so the reads of the batch overlap.
+ *
+ * save() writes it to a file, which load() maps and uses in place.
+ * To build it from a saved model, load() the learner first, and
+ * set_param() it if it is FTRL_Learner_T, see build().
+ */
+template <typename V = float, typename F = uint32_t>
+class Perfect_T
+{
+public:
+	typedef V VALUE;
+	typedef F PRINT;
+
+	/**
+	 * A slot of a weight.
+	 */
+	struct Slot
+	{
+		F print; ///< fingerprint of the key
+		V value; ///< value
+	};
+
+protected:
+	uint32_t key_bits; ///< Atom::KEY_BITS of the learner, see fold()
+	uint32_t n_space; ///< number of feature space
+	double intercept; ///< intercept
+	MPHF mphf; ///< slot of each key
+	std::vector<float> scale; ///< scale of the values of each space
+	std::vector<uint64_t> salt; ///< of each space, see hash()
+	const Slot* slot; ///< slots, mphf.size() of them
+	char * data; ///< slots, built
+	uint64_t data_len; ///< length of data
+	uint32_t alloc; ///< policy of big_alloc() for data, see build()
+	char * file; ///< mapped by load(), holding everything
+	uint64_t file_len; ///< length of file
+
+public:
+	Perfect_T(): key_bits(62), n_space(0), intercept(0), slot(NULL),
+		data(NULL), data_len(0), alloc(ALLOC_PLAIN), file(NULL), file_len(0) {}
+
+	~Perfect_T() { clear(); }
+
+	/**
+	 * Return the number of feature space.
+	 */
+	uint32_t size() const { return n_space; }
+
+	/**
+	 * Return the number of weights.
+	 */
+	uint64_t weights() const { return mphf.size(); }
+
+	/**
+	 * Return the bytes of the slots, pilots and remaps.
+	 */
+	uint64_t bytes() const
+	{
+		return mphf.size()*sizeof(Slot)+mphf.buckets()*sizeof(uint16_t)
+			+(mphf.positions()-mphf.size())*sizeof(uint32_t);
+	}
+
+	/**
+	 * Build it from the weights of a learner.
+	 *
+	 * LEARNER is LR_Learner_T or FTRL_Learner_T, whose weight() of
+	 * each Atom is taken, as Frozen_T::freeze(), so it should be
+	 * weighable(). If two keys of
+	 * different spaces are the same after hash(), one in 2**64, the
+	 * later is dropped.
+	 *
+	 * @param _alloc policy of big_alloc() for the slots
+	 */
+	template <class LEARNER>
+	void build(const LEARNER& l, uint32_t _alloc = ALLOC_PLAIN)
+	{
+		typedef typename LEARNER::ATOM ATOM;
+		if(not l.weighable())
+			error("Cannot build from a learner without its Parameter, set_param() it first.\n");
+		clear();
+		key_bits = ATOM::KEY_BITS;
+		n_space = l.size();
+		intercept = l.bias();
+		alloc = _alloc;
+		scale.assign(n_space,1);
+		set_salt();
+		std::vector<std::pair<uint64_t,V> > kv;
+		for(uint32_t i=0;i<n_space;i++)
+		{
+			if(sizeof(V)==1)
+			{
+				float max_abs = 0;
+				for(auto t=l.m[i].begin();t!=l.m[i].end();t=l.m[i].next(t))
+					max_abs = std::max(max_abs,fabsf(l.weight(*t)));
+				scale[i] = int8_scale(max_abs);
+			}
+			for(auto t=l.m[i].begin();t!=l.m[i].end();t=l.m[i].next(t))
+			{
+				V v;
+				frozen_store(v,l.weight(*t),scale[i]);
+				if((float)v!=0)
+					kv.push_back(std::make_pair(hash(i,t->k & ~ATOM::STATE),v));
+			}
+		}
+		std::stable_sort(kv.begin(),kv.end(),less_key);
+		uint64_t n = 0;
+		for(uint64_t j=0;j<kv.size();j++)
+			if(n==0 or kv[j].first!=kv[n-1].first)
+				kv[n++] = kv[j];
+			else
+				warning("Key 0x%lx is dropped.\n",kv[j].first);
+		kv.resize(n);
+		std::vector<uint64_t> key(n);
+		for(uint64_t j=0;j<n;j++)
+			key[j] = kv[j].first;
+		mphf.build(key.data(),n);
+		data_len = std::max<uint64_t>(n*sizeof(Slot),1);
+		data = (char*)big_alloc(data_len,alloc);
+		if(data==NULL)
+			error("Failed to allocate %lu bytes for a perfect model.\n",data_len);
+		Slot* s = (Slot*)data;
+		for(uint64_t j=0;j<n;j++)
+			s[mphf(kv[j].first)] = {(F)kv[j].first,kv[j].second};
+		slot = s;
+	}
+
+	/**
+	 * Weight of key k of a space.
+	 */
+	inline float weight(uint32_t space, uint64_t k) const
+	{
+		if(mphf.size()==0)
+			return 0;
+		const uint64_t h = hash(space,k);
+		return lookup(h,mphf(h))*(sizeof(V)==1?scale[space]:1);
+	}
+
+	/**
+	 * Make prediction on Sample s, see LR_Learner_T::predict().
+	 *
+	 * As Frozen_T::predict(), PERFECT_BATCH Feature at a time: their
+	 * pilots are prefetched, then their slots, then they are looked up.
+	 */
+	inline double predict(const Sample& s) const
+	{
+		double f = intercept;
+		if(mphf.size()==0)
+			return f;
+		uint64_t h[PERFECT_BATCH];
+		uint64_t j[PERFECT_BATCH];
+		for(uint32_t a=0;a<s.len;a+=PERFECT_BATCH)
+		{
+			const uint32_t b = std::min(s.len,a+PERFECT_BATCH);
+			for(uint32_t x=a;x<b;x++)
+			{
+				const Feature& p = s.x[x];
+				if(p.space >= n_space)
+					continue;
+				h[x-a] = hash(p.space,p.key);
+				mphf.prefetch(h[x-a]);
+			}
+			for(uint32_t x=a;x<b;x++)
+			{
+				if(s.x[x].space >= n_space)
+					continue;
+				j[x-a] = mphf(h[x-a]);
+				__builtin_prefetch(slot+j[x-a]);
+			}
+			for(uint32_t x=a;x<b;x++)
+			{
+				const Feature& p = s.x[x];
+				if(p.space < n_space)
+					f += lookup(h[x-a],j[x-a])*(sizeof(V)==1?scale[p.space]:1)*p.value;
+			}
+		}
+		return f;
+	}
+
+	/**
+	 * Save to a file, see PerfectHead.
+	 */
+	void save(const char * filename) const
+	{
+		info("Save to %s\n",filename);
+		FILE * fo = fopen(filename,"wb");
+		if(!fo)
+			error("Failed to open %s for writing.\n",filename);
+		const uint64_t start = (sizeof(PerfectHead)+n_space*sizeof(float)
+				+PERFECT_ALIGN-1)/PERFECT_ALIGN*PERFECT_ALIGN;
+		const uint64_t n_pilot = mphf.buckets();
+		const uint64_t n_remap = mphf.positions()-mphf.size();
+		const uint64_t pilot = 0;
+		const uint64_t remap = align(pilot+n_pilot*sizeof(uint16_t));
+		const uint64_t at = align(remap+n_remap*sizeof(uint32_t));
+		const uint64_t len = at+mphf.size()*sizeof(Slot);
+		PerfectHead head = {PERFECT_MAGIC,PERFECT_VERSION,sizeof(V),sizeof(F),
+			key_bits,n_space,intercept,mphf.size(),n_pilot,mphf.positions(),
+			pilot,remap,at,start,len};
+		qassert(1==fwrite(&head,sizeof(head),1,fo));
+		qassert(n_space==fwrite(scale.data(),sizeof(float),n_space,fo));
+		qassert(0==fseek(fo,start+pilot,SEEK_SET));
+		qassert(n_pilot==fwrite(mphf.pilots(),sizeof(uint16_t),n_pilot,fo));
+		qassert(0==fseek(fo,start+remap,SEEK_SET));
+		qassert(n_remap==fwrite(mphf.remaps(),sizeof(uint32_t),n_remap,fo));
+		qassert(0==fseek(fo,start+at,SEEK_SET));
+		qassert(mphf.size()==fwrite(slot,sizeof(Slot),mphf.size(),fo));
+		fclose(fo);
+	}
+
+	/**
+	 * Load from a file written by save().
+	 *
+	 * The file is mapped and used in place, so it takes no time to load.
+	 */
+	void load(const char * filename)
+	{
+		int fd = open(filename,O_RDONLY);
+		if(fd<0)
+			error("Failed to load from %s.\n",filename);
+		info("Load from %s\n",filename);
+		const uint64_t len = lseek(fd,0,SEEK_END);
+		if(len<sizeof(PerfectHead))
+			error("%s is not a perfect model.\n",filename);
+		char * mem = (char*)mmap(NULL,len,PROT_READ,MAP_PRIVATE,fd,0);
+		close(fd);
+		if(mem==MAP_FAILED)
+			error("Failed to mmap %s.\n",filename);
+		const PerfectHead* head = (const PerfectHead*)mem;
+		if(head->magic!=PERFECT_MAGIC or head->version!=PERFECT_VERSION)
+			error("%s is not a perfect model of version %u.\n",filename,PERFECT_VERSION);
+		if(head->value_size!=sizeof(V) or head->print_size!=sizeof(F))
+			error("%s has values of %u bytes and fingerprints of %u, expect %lu and %lu.\n",
+					filename,head->value_size,head->print_size,sizeof(V),sizeof(F));
+		qassert(head->data+head->data_len<=len);
+		clear();
+		file = mem;
+		file_len = len;
+		key_bits = head->key_bits;
+		n_space = head->n_space;
+		intercept = head->intercept;
+		const float* sc = (const float*)(head+1);
+		scale.assign(sc,sc+n_space);
+		set_salt();
+		const char* d = mem+head->data;
+		mphf.link(head->n,head->n_bucket,head->m,
+				(const uint16_t*)(d+head->pilot),(const uint32_t*)(d+head->remap));
+		slot = (const Slot*)(d+head->slot);
+	}
+
+protected:
+	/**
+	 * Value of key h in slot j, 0 if the fingerprint differs.
+	 */
+	inline float lookup(uint64_t h, uint64_t j) const
+	{
+		const Slot& s = slot[j];
+		return s.print==(F)h?(float)s.value:0;
+	}
+
+	/**
+	 * Key k of a space as stored, see Frozen_T::hash().
+	 */
+	inline uint64_t hash(uint32_t space, uint64_t k) const
+	{
+		k &= ~(3lu<<62);
+		if(key_bits<62 and k>=(1lu<<key_bits))
+			k = fmix(k)>>(64-key_bits);
+		return fmix(k^salt[space]);
+	}
+
+	/**
+	 * Order of (key,value) by key.
+	 */
+	static bool less_key(const std::pair<uint64_t,V>& a, const std::pair<uint64_t,V>& b)
+	{
+		return a.first<b.first;
+	}
+
+	/**
+	 * Round an offset up to a cache line.
+	 */
+	static inline uint64_t align(uint64_t offset) { return (offset+63)/64*64; }
+
+	/**
+	 * Set salt of each space.
+	 */
+	void set_salt()
+	{
+		salt.resize(n_space);
+		for(uint32_t i=0;i<n_space;i++)
+			salt[i] = fmix((uint64_t)i+1);
+	}
+
+	/**
+	 * Free the slots, or unmap the file.
+	 */
+	void clear()
+	{
+		if(file!=NULL)
+			munmap(file,file_len);
+		else if(data!=NULL)
+			big_free(data,data_len,alloc);
+		file = NULL;
+		data = NULL;
+		data_len = 0;
+		slot = NULL;
+		mphf.link(0,0,0,NULL,NULL);
+	}
+};
+
+typedef Perfect_T<> Perfect;